@@ -0,0 +1,524 @@
+/*
+ * mt-bench -- replay pty output through the terminal core without X.
+ *
+ * usage: mt-bench [-g colsxrows] [-n runs] [-s megabytes] [file ...]
+ *
+ * Without files a set of synthetic workloads is generated: dense ASCII,
+ * SGR colored text, truecolor, CJK, scrolling regions and a cursor
+ * motion heavy TUI. Files are replayed as recorded streams instead, for
+ * example captures made with script(1). Every workload is written into
+ * a socket pair and read back through ttyread(), the same path the pty
+ * takes. The other workloads measure the rest of the core:
+ *
+ * - snapshot copies the whole screen the way the X thread takes a frame.
+ *   A cell counts as a byte.
+ * - clear erases the whole screen in alternating colors. A cleared cell
+ *   counts as a byte.
+ * - reflow drags the window of a full screen and history through every
+ *   width down to half and back. It counts resizes: MB/s is "-" and
+ *   ns/byte is the time per resize.
+ * - statesave, statewrite and stateload save a full history and both
+ *   screens as a session does, write the file and restore it. A byte of
+ *   the file counts as a byte. The restored state must save the same.
+ *
+ * One line per workload is printed as
+ * "workload bytes runs seconds MB/s ns/byte" with the best run.
+ */
+#include "mt.h"
+#include "x.h"
+
+#include <cerrno>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LEN(a) (sizeof(a) / sizeof(a)[0])
+
+typedef struct {
+  const char *name;
+  void (*gen)(std::string &, size_t);
+} Workload;
+
+typedef struct {
+  int fd;
+  const std::string *data;
+} Feed;
+
+static void usage(void);
+static double now(void);
+static void word(std::string &);
+static void genascii(std::string &, size_t);
+static void gensgr(std::string &, size_t);
+static void gentruecolor(std::string &, size_t);
+static void gencjk(std::string &, size_t);
+static void genscroll(std::string &, size_t);
+static void gentui(std::string &, size_t);
+static void *feed(void *);
+static double replay(const std::string &);
+static void bench(const char *, const std::string &, int);
+static void benchsnapshot(size_t, int);
+static void benchclear(size_t, int);
+static void benchreflow(size_t, int);
+static void benchstate(size_t, int);
+static std::string statepath(int);
+static void report(const char *, size_t, int, double);
+static int readfile(const char *, std::string &);
+
+static const Workload workloads[] = {
+    {"ascii", genascii},   {"sgr", gensgr},       {"truecolor", gentruecolor},
+    {"cjk", gencjk},       {"scroll", genscroll}, {"tui", gentui},
+};
+
+static int sv[2];
+
+/* the frontend is not linked, the terminal core only needs these */
+void draw(void) {}
+void drawregion(int, int, int, int) {}
+void xbell(void) {}
+void xclipcopy(void) {}
+void xclippaste(void) {}
+void xhints(void) {}
+void xloadcols(void) {}
+int xsetcolorname(int, const char *) { return 1; }
+void xsetfontsize(double) {}
+double xdefaultfontsize(void) { return 0; }
+double xfontsize(void) { return 0; }
+void xsetenv(void) {}
+void xsettitle(const char *) {}
+void xsetpointermotion(int) {}
+void xseturgency(int) {}
+void xresize(int, int) {}
+void xselpaste(void) {}
+unsigned long xwinid(void) { return 0; }
+void xsetsel(char *str, Time) { free(str); }
+
+void usage(void) {
+  die("usage: mt-bench [-g colsxrows] [-n runs] [-s megabytes] [file ...]\n");
+}
+
+double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+void word(std::string &s) {
+  int n = 1 + rand() % 10;
+
+  while (n--)
+    s += 'a' + rand() % 26;
+}
+
+/* compiler and build logs: long lines of plain text */
+void genascii(std::string &s, size_t len) {
+  int n;
+
+  while (s.size() < len) {
+    for (n = rand() % 140; n > 0; n--)
+      s += ' ' + rand() % 95;
+    s += "\r\n";
+  }
+}
+
+/* ls --color, diagnostics: short colored words with frequent resets */
+void gensgr(std::string &s, size_t len) {
+  static const char *attr[] = {"1;31", "32", "1;34", "33;44", "4;36",
+                               "7",    "38;5;208", "2;35"};
+  char buf[32];
+
+  while (s.size() < len) {
+    snprintf(buf, sizeof(buf), "\033[%sm", attr[rand() % LEN(attr)]);
+    s += buf;
+    word(s);
+    s += "\033[0m ";
+    word(s);
+    s += rand() % 8 ? " " : "\r\n";
+  }
+}
+
+/* gradients and syntax highlighters: a 24-bit color for every few runes */
+void gentruecolor(std::string &s, size_t len) {
+  char buf[64];
+  int i = 0;
+
+  while (s.size() < len) {
+    snprintf(buf, sizeof(buf), "\033[38;2;%d;%d;%d;48;2;%d;%d;%dm%c",
+             rand() % 256, rand() % 256, rand() % 256, rand() % 256,
+             rand() % 256, rand() % 256, ' ' + rand() % 95);
+    s += buf;
+    if (++i % 80 == 0)
+      s += "\033[m\r\n";
+  }
+}
+
+/* Han, kana and hangul text mixed with ASCII */
+void gencjk(std::string &s, size_t len) {
+  char buf[UTF_SIZ];
+  Rune u;
+  int i = 0;
+
+  while (s.size() < len) {
+    switch (rand() % 4) {
+    case 0:
+      u = 0x4e00 + rand() % 0x5200;
+      break;
+    case 1:
+      u = 0x3040 + rand() % 0xc0;
+      break;
+    case 2:
+      u = 0xac00 + rand() % 0x2ba4;
+      break;
+    default:
+      u = ' ' + rand() % 95;
+      break;
+    }
+    s.append(buf, utf8encode(u, buf));
+    if (++i % 50 == 0)
+      s += "\r\n";
+  }
+}
+
+/* pagers and editors: a scrolling region with inserts, deletes and RI */
+void genscroll(std::string &s, size_t len) {
+  char buf[64];
+
+  snprintf(buf, sizeof(buf), "\033[2;%dr", rows - 1);
+  s += buf;
+  while (s.size() < len) {
+    switch (rand() % 6) {
+    case 0:
+      snprintf(buf, sizeof(buf), "\033[2H\033[%dL", 1 + rand() % 3);
+      break;
+    case 1:
+      snprintf(buf, sizeof(buf), "\033[%dH\033[%dM", 2 + rand() % (rows - 2),
+               1 + rand() % 3);
+      break;
+    case 2:
+      snprintf(buf, sizeof(buf), "\033[2H\033M");
+      break;
+    default:
+      snprintf(buf, sizeof(buf), "\033[%dH\n", rows - 1);
+      break;
+    }
+    s += buf;
+    word(s);
+    s += ' ';
+    word(s);
+  }
+  s += "\033[r";
+}
+
+/* top and friends: jump around, overwrite fields, clear to end of line */
+void gentui(std::string &s, size_t len) {
+  char buf[64];
+
+  while (s.size() < len) {
+    snprintf(buf, sizeof(buf), "\033[%d;%dH", 1 + rand() % rows,
+             1 + rand() % cols);
+    s += buf;
+    if (rand() % 3 == 0)
+      s += "\033[7m";
+    snprintf(buf, sizeof(buf), "%5d %4.1f", rand() % 100000,
+             rand() % 1000 / 10.0);
+    s += buf;
+    s += rand() % 2 ? "\033[K" : "\033[m";
+  }
+}
+
+/* write the stream and drop whatever the terminal answers */
+void *feed(void *arg) {
+  Feed *f = (Feed *)arg;
+  const char *p = f->data->data();
+  size_t left = f->data->size();
+  struct pollfd pfd = {f->fd, POLLIN | POLLOUT, 0};
+  char discard[BUFSIZ];
+  ssize_t n;
+
+  while (left > 0 && poll(&pfd, 1, -1) >= 0) {
+    if (pfd.revents & POLLIN)
+      while (read(f->fd, discard, sizeof(discard)) > 0)
+        ;
+    if (!(pfd.revents & POLLOUT))
+      continue;
+    if ((n = write(f->fd, p, left)) < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        continue;
+      die("mt-bench: write: %s\n", strerror(errno));
+    }
+    p += n;
+    left -= n;
+  }
+  return NULL;
+}
+
+double replay(const std::string &data) {
+  Feed f = {sv[1], &data};
+  struct pollfd pfd = {cmdfd, POLLIN, 0};
+  pthread_t thread;
+  size_t done = 0;
+  double start;
+
+  start = now();
+  if (pthread_create(&thread, NULL, feed, &f))
+    die("mt-bench: pthread_create failed\n");
+  while (done < data.size()) {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      die("mt-bench: poll: %s\n", strerror(errno));
+    done += ttyread();
+  }
+  pthread_join(thread, NULL);
+  return now() - start;
+}
+
+void bench(const char *name, const std::string &data, int runs) {
+  /* RIS first, so that every run starts from the same state */
+  std::string stream = "\033c" + data;
+  double t, best = 0;
+  int i;
+
+  for (i = 0; i < runs; i++) {
+    t = replay(stream);
+    if (i == 0 || t < best)
+      best = t;
+  }
+  report(name, stream.size(), runs, best);
+}
+
+void benchsnapshot(size_t len, int runs) {
+  static Term snap;
+  static Selection snapsel;
+  std::string data;
+  size_t cells = (size_t)cols * rows, frames = MAX(len / cells, 1), f;
+  double t, best = 0;
+  int i;
+
+  /* a screen full of colored text */
+  srand(1);
+  gensgr(data, cells * 2);
+  replay("\033c" + data);
+
+  for (i = 0; i < runs; i++) {
+    t = now();
+    for (f = 0; f < frames; f++) {
+      tsetdirt(0, rows - 1);
+      tsnapshot(&snap, &snapsel);
+    }
+    t = now() - t;
+    if (i == 0 || t < best)
+      best = t;
+  }
+  report("snapshot", frames * cells, runs, best);
+}
+
+void benchclear(size_t len, int runs) {
+  std::string data = "\033c";
+  size_t cells = (size_t)cols * rows, frames = MAX(len / cells, 1), f;
+  double t, best = 0;
+  int i;
+
+  /* every clear is in another background, so that each cell changes */
+  for (f = 0; f < frames; f++)
+    data += f % 2 ? "\033[42m\033[2J" : "\033[41m\033[2J";
+
+  for (i = 0; i < runs; i++) {
+    t = replay(data);
+    if (i == 0 || t < best)
+      best = t;
+  }
+  report("clear", frames * cells, runs, best);
+}
+
+void benchreflow(size_t len, int runs) {
+  std::string data;
+  size_t steps = 0;
+  double t, best = 0;
+  int i, c;
+
+  /* long lines, so that many of them wrap */
+  srand(1);
+  genascii(data, MIN(len, (size_t)4 << 20));
+  data = "\033c" + data;
+
+  /* the window is resized in pixels, make them cells */
+  win.cw = win.ch = 1;
+  for (i = 0; i < runs; i++) {
+    replay(data);
+    t = now();
+    for (c = cols - 1, steps = 0; c >= (int)cols / 2; c--, steps++)
+      cresize(c + 2 * borderpx, rows + 2 * borderpx);
+    for (c++; c <= (int)cols; c++, steps++)
+      cresize(c + 2 * borderpx, rows + 2 * borderpx);
+    t = now() - t;
+    if (i == 0 || t < best)
+      best = t;
+  }
+  /* a resize is no byte, the time per resize is all there is to report */
+  printf("reflow %zu %d %.6f - %.3f\n", steps, runs, best,
+         best * 1E9 / steps);
+  fflush(stdout);
+}
+
+/*
+ * Saves a full history of colored text with a screen on either side,
+ * then more lines on top of that, restores the result and checks that a
+ * save of it is the same as a save of the terminal it came from.
+ */
+void benchstate(size_t len, int runs) {
+  std::string data, more, saved, restored;
+  size_t cells = (size_t)cols * rows;
+  struct timespec later = {};
+  double t, save = 0, write = 0, load = 0;
+  int i, k;
+
+  srand(1);
+  gensgr(data, MIN(len, (size_t)8 << 20));
+  data = "\033c" + data + "\033[?1049h";
+  gentui(data, data.size() + cells * 4);
+  more = "\033[?1049l";
+  gensgr(more, cells * 2);
+  more += "\033[?1049h";
+  gentui(more, more.size() + cells * 4);
+
+  for (i = 0; i < runs; i++) {
+    for (k = 0; k < 3; k++)
+      unlink(statepath(k).c_str());
+    replay(data);
+
+    /* the first save writes everything, the next one only what is new */
+    tstateopen(statepath(0).c_str());
+    later.tv_sec += 3600;
+    t = now();
+    tstatesave(&later);
+    t = now() - t;
+    if (i == 0 || t < save)
+      save = t;
+    t = now();
+    tstatesync();
+    t = now() - t;
+    if (i == 0 || t < write)
+      write = t;
+    replay(more);
+    later.tv_sec += 3600;
+    tstatesave(&later);
+
+    /* the same terminal saved at once, then restored and saved again */
+    tstateopen(statepath(1).c_str());
+    later.tv_sec += 3600;
+    tstatesave(&later);
+    tstatesync();
+    t = now();
+    if (tstateload(statepath(0).c_str()) < 0)
+      die("mt-bench: can't restore %s\n", statepath(0).c_str());
+    t = now() - t;
+    if (i == 0 || t < load)
+      load = t;
+    tstateopen(statepath(2).c_str());
+    later.tv_sec += 3600;
+    tstatesave(&later);
+    tstatesync();
+
+    saved.clear();
+    restored.clear();
+    if (readfile(statepath(1).c_str(), saved) < 0 ||
+        readfile(statepath(2).c_str(), restored) < 0 || saved != restored)
+      die("mt-bench: the restored state differs\n");
+  }
+  for (k = 0; k < 3; k++)
+    unlink(statepath(k).c_str());
+  report("statesave", saved.size(), runs, save);
+  report("statewrite", saved.size(), runs, write);
+  report("stateload", saved.size(), runs, load);
+}
+
+std::string statepath(int n) {
+  const char *dir = getenv("TMPDIR");
+
+  return std::string(dir ? dir : "/tmp") + "/mt-bench-" +
+         std::to_string(getpid()) + "-" + std::to_string(n) + ".state";
+}
+
+void report(const char *name, size_t bytes, int runs, double best) {
+  printf("%s %zu %d %.6f %.2f %.3f\n", name, bytes, runs, best,
+         bytes / best / 1E6, best * 1E9 / bytes);
+  fflush(stdout);
+}
+
+int readfile(const char *path, std::string &s) {
+  char buf[BUFSIZ];
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    s.append(buf, n);
+  close(fd);
+  return n < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t len = 16 << 20;
+  int runs = 5, opt, i;
+  const char *name;
+
+  while ((opt = getopt(argc, argv, "g:n:s:")) != -1) {
+    switch (opt) {
+    case 'g':
+      if (sscanf(optarg, "%ux%u", &cols, &rows) != 2 || cols < 1 || rows < 3)
+        usage();
+      break;
+    case 'n':
+      if ((runs = atoi(optarg)) < 1)
+        usage();
+      break;
+    case 's':
+      len = strtod(optarg, NULL) * (1 << 20);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  setlocale(LC_CTYPE, "");
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    die("mt-bench: socketpair: %s\n", strerror(errno));
+  for (i = 0; i < 2; i++)
+    fcntl(sv[i], F_SETFL, fcntl(sv[i], F_GETFL) | O_NONBLOCK);
+  cmdfd = sv[0];
+  tnew(cols, rows);
+
+  printf("# workload bytes runs seconds MB/s ns/byte\n");
+  if (optind < argc) {
+    for (i = optind; i < argc; i++) {
+      std::string data;
+
+      if (readfile(argv[i], data) < 0)
+        die("mt-bench: can't read %s: %s\n", argv[i], strerror(errno));
+      name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+      bench(name, data, runs);
+    }
+    return 0;
+  }
+
+  for (i = 0; i < LEN(workloads); i++) {
+    std::string data;
+
+    srand(1);
+    workloads[i].gen(data, len);
+    bench(workloads[i].name, data, runs);
+  }
+  benchsnapshot(len, runs);
+  benchclear(len, runs);
+  benchreflow(len, runs);
+  benchstate(len, runs);
+  return 0;
+}
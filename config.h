@@ -31,11 +31,79 @@ unsigned int tripleclicktimeout = 600;
 // This allows fullscreen editors etc to restore the screen contents on exit.
 int allowaltscreen = 1;
 
+// Seconds after leaving the alternate screen that its memory is freed; it is
+// allocated again, blank, the next time it is entered. 0 keeps it for good.
+static unsigned int altscreentimeout = 60;
+
 // Maximum redraw rate for events triggered by the UI (keystrokes, mouse).
 unsigned int xfps = 120;
 // Maximum redraw rate for events triggered by the terminal (program output).
 unsigned int actionfps = 30;
 
+// Flood mode: while program output arrives faster than floodbytes per second,
+// the screen is only drawn floodfps times per second and the rest of the time
+// goes into parsing. Keyboard and mouse input is still handled as it arrives.
+// The final state is drawn as soon as the output stops.
+// Set floodstats to print what each flood cost to stderr.
+unsigned int floodbytes = 8 * 1024 * 1024;
+unsigned int floodfps = 4;
+int floodstats = 0;
+
+// Parse program output on a separate thread?
+// The X thread then only handles input and draws snapshots of the screen, so
+// bursts of output don't delay keystrokes and a slow X server doesn't delay
+// parsing.
+int threaded = 0;
+
+// Draw the changed rows of a frame in batches per color: the backgrounds and
+// borders of all rows as one fill, the glyphs of each row as one composite
+// from the glyph sets Xft keeps on the server, then the lines as one fill.
+// 0 draws each run of attributes on its own. The requests saved depend on the
+// X server and the output; floodstats reports the requests each flood sent,
+// to compare the two on a given display.
+int renderrows = 1;
+
+// Draw the cells into an image in mt and upload the rectangles that changed,
+// through shared memory when the X server runs on the same machine. Takes
+// fewer requests than Xft for large windows on remote X and VNC servers.
+// -r turns it on.
+int rasterize = 0;
+
+// Budget for draining program output from the pty in one go, in bytes and
+// milliseconds. Input keeps being read and parsed until the pty would block
+// or either budget runs out, then the screen gets a chance to redraw.
+static unsigned int ttyreadbytes = 1024 * 1024;
+static unsigned int ttyreadtime = 10;
+
+// Longest OSC or DCS string accepted, in bytes. This bounds the size of a
+// clipboard transfer with OSC 52; longer strings are dropped as a whole.
+static unsigned int strmaxbytes = 64 * 1024 * 1024;
+
+// Width in cells of the characters Unicode calls "East Asian Ambiguous"
+// (Greek, Cyrillic, box drawing, ...): 1 for western fonts, 2 to match CJK
+// fonts and legacy CJK terminals.
+static int ambiguouswidth = 1;
+
+// Scrollback: lines kept after they leave the top of the screen, and the
+// memory they may take up in megabytes. 0 lines disables the history, 0
+// megabytes leaves its memory unbounded.
+static unsigned int histlines = 10000;
+static unsigned int histmegabytes = 32;
+
+// Sessions: started with -s name, mt saves its screens, history and modes to
+// a file every stateinterval milliseconds while they change, and the next mt
+// started with that name restores them. The file is in statedir, or in
+// $XDG_RUNTIME_DIR when that is NULL, which is emptied at logout and reboot:
+// name a directory on disk, or pass -s a path, to keep sessions across those.
+// Without $XDG_RUNTIME_DIR it is in $XDG_STATE_HOME/mt or ~/.local/state/mt.
+// Only files of the user's own that others can't write are restored.
+static unsigned int stateinterval = 2000;
+static const char *statedir = NULL;
+
+// Longest a synchronized update (DECSET 2026) may hold back drawing, in ms.
+// Protects against applications that never end the update.
+static unsigned int synctimeout = 150;
+
 // Blink period in ms, for text with the blinking attribute.
 // 0 disables blinking.
 unsigned int blinktimeout = 800;
@@ -127,19 +195,25 @@ unsigned int mouseshape = XC_xterm;
 unsigned int mousefg = 7;
 unsigned int mousebg = 0;
 
-// Mouse shortcuts.
-// The default values map the scroll wheel (Button4/5) to ^Y/^E (vim commands).
+// Mouse shortcuts, either a string to send or a function to call. The last
+// field limits them to the primary (-1) or the alternate (1) screen, 0 is both.
+// The default values scroll the history with the wheel (Button4/5) and send
+// ^Y/^E (vim commands) to applications on the alternate screen.
 // Note that mapping Button1 will interfere with selection.
 MouseShortcut mshortcuts[] = {
-  /* button               mask            string */
-  { Button4,              XK_ANY_MOD,     "\031" },
-  { Button5,              XK_ANY_MOD,     "\005" },
+  /* button      mask          string    function      argument  screen */
+  { Button4,     XK_ANY_MOD,   NULL,     kscrollup,    3,        -1 },
+  { Button5,     XK_ANY_MOD,   NULL,     kscrolldown,  3,        -1 },
+  { Button4,     XK_ANY_MOD,   "\031",   NULL,         0,         1 },
+  { Button5,     XK_ANY_MOD,   "\005",   NULL,         0,         1 },
 };
 
 // Keyboard shortcuts that trigger internal functions.
 Shortcut shortcuts[] = {
   // mask                      keysym          function        argument
   { XK_ANY_MOD,                XK_Break,       sendbreak,      0 },
+  { ShiftMask,                 XK_Prior,       kscrollup,      -1 },
+  { ShiftMask,                 XK_Next,        kscrolldown,    -1 },
   { ControlMask,               XK_Print,       toggleprinter,  0 },
   { ShiftMask,                 XK_Print,       printscreen,    0 },
   { XK_ANY_MOD,                XK_Print,       printsel,       0 },
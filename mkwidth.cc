@@ -0,0 +1,211 @@
+/*
+ * mkwidth -- generate width.h from the Unicode character database.
+ *
+ * usage: mkwidth UnicodeData.txt EastAsianWidth.txt > width.h
+ *
+ * The table is split in blocks of 256 runes, identical blocks are
+ * shared and every rune takes 2 bits, see runewidthclass() in the
+ * generated header.
+ */
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+enum { W_ZERO, W_NARROW, W_WIDE, W_AMBIGUOUS };
+
+#define NRUNES 0x110000
+#define BLOCK 256
+
+static char gc[NRUNES][3]; /* general category, "" when unassigned */
+static char eaw[NRUNES];   /* 'W', 'F', 'A' or 0 for the others */
+static char version[32] = "unknown";
+
+static void die(const char *, ...);
+static FILE *xopen(const char *);
+static void readunicodedata(const char *);
+static void readeastasianwidth(const char *);
+static int widthof(uint32_t);
+static char *strip(char *);
+
+void die(const char *errstr, ...) {
+  va_list ap;
+
+  va_start(ap, errstr);
+  vfprintf(stderr, errstr, ap);
+  va_end(ap);
+  exit(1);
+}
+
+FILE *xopen(const char *path) {
+  FILE *fp;
+
+  if (!(fp = fopen(path, "r")))
+    die("mkwidth: can't open %s: %s\n", path, strerror(errno));
+  return fp;
+}
+
+char *strip(char *s) {
+  char *e;
+
+  while (*s == ' ' || *s == '\t')
+    s++;
+  for (e = s + strlen(s); e > s && strchr(" \t\r\n", e[-1]); e--)
+    ;
+  *e = '\0';
+  return s;
+}
+
+/* fields: code;name;category;... with <..., First>/<..., Last> ranges */
+void readunicodedata(const char *path) {
+  char line[512], *name, *cat;
+  unsigned long u, first = 0;
+  FILE *fp = xopen(path);
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (!(name = strchr(line, ';')) || !(cat = strchr(name + 1, ';')))
+      continue;
+    *name++ = *cat++ = '\0';
+    cat[2] = '\0';
+    if ((u = strtoul(line, NULL, 16)) >= NRUNES)
+      die("mkwidth: bad code point %s\n", line);
+    if (strstr(name, ", First>")) {
+      first = u;
+      continue;
+    }
+    if (!strstr(name, ", Last>"))
+      first = u;
+    for (; first <= u; first++)
+      memcpy(gc[first], cat, 3);
+  }
+  fclose(fp);
+}
+
+/* lines: code[..code];property # comment */
+void readeastasianwidth(const char *path) {
+  char line[512], *p, *prop;
+  unsigned long lo, hi;
+  FILE *fp = xopen(path);
+
+  while (fgets(line, sizeof(line), fp)) {
+    /* the header names the file with its Unicode version */
+    if (sscanf(line, "# EastAsianWidth-%31[0-9.]", version) == 1)
+      version[strlen(version) - 1] = '\0'; /* the dot of ".txt" */
+    if ((p = strchr(line, '#')))
+      *p = '\0';
+    if (!(prop = strchr(line, ';')))
+      continue;
+    *prop++ = '\0';
+    prop = strip(prop);
+    lo = hi = strtoul(line, &p, 16);
+    if (p[0] == '.' && p[1] == '.')
+      hi = strtoul(p + 2, NULL, 16);
+    if (hi >= NRUNES || lo > hi)
+      die("mkwidth: bad range %s\n", line);
+    if (strcmp(prop, "W") && strcmp(prop, "F") && strcmp(prop, "A"))
+      continue;
+    for (; lo <= hi; lo++)
+      eaw[lo] = prop[0];
+  }
+  fclose(fp);
+}
+
+int widthof(uint32_t u) {
+  const char *c = gc[u];
+
+  /* Hangul medial vowels and final consonants combine with the lead */
+  if ((u >= 0x1160 && u <= 0x11ff) || (u >= 0xd7b0 && u <= 0xd7ff))
+    return W_ZERO;
+  /* soft hyphen and the prepended concatenation marks are visible */
+  if (u == 0x00ad || (u >= 0x0600 && u <= 0x0605) || u == 0x06dd ||
+      u == 0x070f || u == 0x0890 || u == 0x0891 || u == 0x08e2 ||
+      u == 0x110bd || u == 0x110cd)
+    return W_NARROW;
+  if (!strcmp(c, "Mn") || !strcmp(c, "Me") || !strcmp(c, "Cf") ||
+      !strcmp(c, "Cc"))
+    return W_ZERO;
+
+  /* unassigned runes of the ideograph planes default to wide */
+  if (!c[0] && ((u >= 0x3400 && u <= 0x4dbf) || (u >= 0x4e00 && u <= 0x9fff) ||
+                (u >= 0xf900 && u <= 0xfaff) ||
+                (u >= 0x20000 && u <= 0x3fffd)))
+    return W_WIDE;
+
+  switch (eaw[u]) {
+  case 'W':
+  case 'F':
+    return W_WIDE;
+  case 'A':
+    return W_AMBIGUOUS;
+  }
+  return W_NARROW;
+}
+
+int main(int argc, char *argv[]) {
+  std::map<std::string, int> index;
+  std::vector<std::string> blocks;
+  std::vector<int> stage1;
+  uint32_t u, b;
+  int i;
+
+  if (argc != 3)
+    die("usage: mkwidth UnicodeData.txt EastAsianWidth.txt\n");
+  readunicodedata(argv[1]);
+  readeastasianwidth(argv[2]);
+
+  for (b = 0; b < NRUNES; b += BLOCK) {
+    std::string packed(BLOCK / 4, '\0');
+
+    for (u = b; u < b + BLOCK; u++)
+      packed[(u - b) / 4] |= widthof(u) << (u % 4 * 2);
+    if (!index.count(packed)) {
+      index[packed] = blocks.size();
+      blocks.push_back(packed);
+    }
+    stage1.push_back(index[packed]);
+  }
+  if (blocks.size() > 256)
+    die("mkwidth: %zu blocks don't fit the first stage\n", blocks.size());
+
+  printf("/* Generated by mkwidth from Unicode %s, do not edit. */\n"
+         "#ifndef MT_WIDTH_H\n"
+         "#define MT_WIDTH_H\n\n"
+         "#include <cstdint>\n\n"
+         "enum runewidth_class {\n"
+         "  WIDTH_ZERO,\n"
+         "  WIDTH_NARROW,\n"
+         "  WIDTH_WIDE,\n"
+         "  WIDTH_AMBIGUOUS,\n"
+         "};\n\n",
+         version);
+
+  printf("static constexpr uint8_t widthstage1[%zu] = {", stage1.size());
+  for (i = 0; i < stage1.size(); i++)
+    printf("%s%d,", i % 16 ? " " : "\n  ", stage1[i]);
+  printf("\n};\n\n");
+
+  printf("static constexpr uint8_t widthstage2[%zu][%d] = {\n", blocks.size(),
+         BLOCK / 4);
+  for (const std::string &blk : blocks) {
+    printf("  {");
+    for (i = 0; i < blk.size(); i++)
+      printf("%s0x%02x,", i % 12 ? " " : "\n    ", (uint8_t)blk[i]);
+    printf("\n  },\n");
+  }
+  printf("};\n\n");
+
+  printf("static inline int runewidthclass(uint32_t u) {\n"
+         "  if (u >= 0x%x)\n"
+         "    return WIDTH_NARROW;\n"
+         "  return (widthstage2[widthstage1[u >> 8]][(u & 0xff) >> 2] >>\n"
+         "          (u & 3) * 2) & 3;\n"
+         "}\n\n"
+         "#endif\n",
+         NRUNES);
+  return 0;
+}
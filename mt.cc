@@ -1,7 +1,14 @@
 #include "mt.h"
+#include "width.h"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <cctype>
 #include <cerrno>
@@ -22,6 +29,7 @@ extern "C" {
 #include <libgen.h>
 #include <pwd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -39,14 +47,35 @@ extern "C" {
 #endif
 }
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "x.h"
 
 /* Arbitrary sizes */
 #define UTF_INVALID 0xFFFD
 #define ESC_BUF_SIZ (128 * UTF_SIZ)
-#define ESC_ARG_SIZ 16
-#define STR_BUF_SIZ ESC_BUF_SIZ
-#define STR_ARG_SIZ ESC_ARG_SIZ
+#define ESC_ARG_SIZ 32 /* one bit each in CSIEscape.sub */
+#define ESC_ARG_MAX 65535
+#define STR_BUF_SIZ ESC_BUF_SIZ /* kept between strings */
+#define STR_ARG_SIZ 16
+#define TTYBUF_MIN (64 * 1024)
+#define TTYOUTQ_MAX (1024 * 1024) /* replies queued while parsing */
+#define COLOR_MIN 256
+#define COLOR_MAX (USHRT_MAX + 1) /* what MTGlyph.color can index */
+#define COLOR_FREE UINT32_MAX     /* fg and bg of a released pair */
+#define HIST_MIN 256
+#define HISTRUNS(l) ((HistRun *)((l) + 1))
+#define HISTLINE(h, i) ((h).line[((h).first + (i)) & ((h).size - 1)])
+#define HISTSIZE(nrun, ntext)                                                 \
+  (sizeof(HistLine) + (nrun) * sizeof(HistRun) + (ntext))
+#define STATE_VERSION 1
+#define STATE_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define STATE_CHUNK (16 << 20) /* history bytes per H record */
+#define STATE_LAYOUT                                                          \
+  (sizeof(MTGlyph) | sizeof(HistRun) << 8 | sizeof(StateHead) << 16)
+#define ISBLANKGLYPH(g) ((g).u == ' ' && !(g).mode && !(g).color)
 
 /* macros */
 #define NUMMAXLEN(x) ((int)(sizeof(x) * 2.56 + 0.5) + 1)
@@ -54,6 +83,7 @@ extern "C" {
 #define ISCONTROLC0(c) (BETWEEN(c, 0, 0x1f) || (c) == '\177')
 #define ISCONTROLC1(c) (BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
+#define ISPRINTASCII(c) (BETWEEN(c, 0x20, 0x7e))
 
 /* constants */
 #define ISO14755CMD "dmenu -w %lu -p codepoint: </dev/null"
@@ -76,38 +106,188 @@ enum charset {
   CS_FIN
 };
 
-enum escape_state {
-  ESC_START = 1,
-  ESC_CSI = 2,
-  ESC_STR = 4, /* OSC, PM, APC */
-  ESC_ALTCHARSET = 8,
-  ESC_STR_END = 16, /* a final string was encountered */
-  ESC_TEST = 32,    /* Enter in test mode */
-  ESC_UTF8 = 64,
-  ESC_DCS = 128,
+/*
+ * States of the DEC ANSI parser, see https://vt100.net/emu/dec_ansi_parser
+ * Ground must stay 0: the ASCII fast path checks for it.
+ */
+enum vt_state {
+  VT_GROUND,
+  VT_ESCAPE,
+  VT_ESCAPE_INTERMEDIATE,
+  VT_CSI_ENTRY,
+  VT_CSI_PARAM,
+  VT_CSI_INTERMEDIATE,
+  VT_CSI_IGNORE,
+  VT_DCS_ENTRY,
+  VT_DCS_PARAM,
+  VT_DCS_INTERMEDIATE,
+  VT_DCS_PASSTHROUGH,
+  VT_DCS_IGNORE,
+  VT_OSC_STRING,
+  VT_SOS_PM_APC_STRING,
+  VT_NSTATES,
+  VT_STAY = 15 /* no transition, run the action only */
+};
+
+enum vt_action {
+  VT_NONE, /* also the "ignore" action */
+  VT_PRINT,
+  VT_EXECUTE,
+  VT_COLLECT,
+  VT_PARAM,
+  VT_ESC_DISPATCH,
+  VT_CSI_DISPATCH,
+  VT_PUT,
+  VT_OSC_PUT,
+  VT_OSC_END
 };
 
+/*
+ * The transition table is indexed by the state and the rune, runes
+ * from 0xa0 up are folded into a single class and behave like GL
+ * characters. Each entry packs the action in the high nibble and the
+ * next state in the low one.
+ */
+#define VT_NCLASSES 0xa1
+
+typedef struct {
+  uint8_t t[VT_NSTATES][VT_NCLASSES];
+} VtTable;
+
 /* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode> [<mode>]] */
+/* ESC '[' [<priv>] [<arg> [[;:] <arg>]...] [<mode>] <mode> */
 typedef struct {
-  char buf[ESC_BUF_SIZ]; /* raw string */
-  int len;               /* raw string length */
-  char priv;
+  char priv; /* private marker: '?', '<', '=' or '>' */
   int arg[ESC_ARG_SIZ];
-  int narg; /* nb of args */
-  char mode[2];
+  uint32_t sub; /* bit n set: arg[n] is a ':' sub-parameter of arg[n - 1] */
+  int narg;     /* nb of args */
+  char mode[2]; /* intermediate and final bytes */
+  int nmode;
 } CSIEscape;
 
 /* STR Escape sequence structs */
 /* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
 typedef struct {
-  char type;             /* ESC type ... */
-  char buf[STR_BUF_SIZ]; /* raw string */
-  int len;               /* raw string length */
+  char type;   /* ESC type ... */
+  char *buf;   /* raw string */
+  size_t len;  /* raw string length */
+  size_t size; /* allocated size of buf */
+  size_t total; /* bytes received, checked against strmaxbytes */
   char *args[STR_ARG_SIZ];
   int narg; /* nb of args */
+  /* OSC 52 payload, base64-decoded as it arrives */
+  int b64;      /* B64_OFF, B64_DATA, B64_END or B64_ERROR */
+  uint32_t acc; /* pending bits */
+  int accbits;
+  char *dec;
+  size_t declen, decsize;
 } STREscape;
 
+enum base64_state {
+  B64_OFF,   /* the string is buffered */
+  B64_DATA,  /* decoding */
+  B64_END,   /* padding seen, the rest is ignored */
+  B64_ERROR, /* invalid digit */
+};
+
+/* Ring buffer of input read from the pty */
+typedef struct {
+  char *buf;
+  size_t size; /* capacity, a power of two */
+  size_t rd;   /* offset of the next byte to parse */
+  size_t wr;   /* offset of the next byte to read */
+} TtyBuf;
+
+/* Interning of the color pairs in term.colors */
+typedef struct {
+  uint32_t *hash; /* index + 1 of the pairs by hash, 0 when empty */
+  ushort *free;   /* released entries, reused first */
+  int nfree;
+  int size;  /* capacity of term.colors, hash has twice as many slots */
+  int dirty; /* first entry changed since the last snapshot */
+  int sweepwait; /* new pairs left to draw in the default colors */
+} ColorTable;
+
+/*
+ * Lines that scrolled off the top of the screen. A line is stored as its
+ * attribute runs followed by the UTF-8 of its runes: trailing blanks are
+ * dropped and the dummies after wide glyphs are implied.
+ */
+typedef struct {
+  ushort len;  /* glyphs in the run */
+  ushort mode; /* attribute flags */
+  uint32_t fg; /* colors, not interned: the history would pin them */
+  uint32_t bg;
+} HistRun;
+
+typedef struct {
+  uint32_t size; /* bytes of the line, this header included */
+  ushort nrun;   /* runs after the header, then the text */
+} HistLine;
+
+typedef struct {
+  HistLine **line; /* ring of lines, oldest at first */
+  size_t size;     /* capacity of the ring, a power of two */
+  size_t first;
+  size_t n;      /* lines held */
+  size_t bytes;  /* memory held by the lines */
+  size_t pushed; /* lines ever appended, the last one is number pushed - 1 */
+  uint epoch;    /* changes when the lines are cleared or rewrapped */
+} History;
+
+/* a line being encoded or rewrapped: its runs and their UTF-8 */
+typedef struct {
+  std::vector<HistRun> runs;
+  std::string text;
+  int cols; /* columns the runs take up */
+} HistBuf;
+
+/*
+ * The state file of a session: a StateFile header and records, each with
+ * a checksum and padded to 8 bytes. H records hold history lines by their
+ * number, S records everything else and which lines make up the history.
+ * The last intact S record is the state. A save appends the lines pushed
+ * since the previous one and an S record, once the file holds twice what
+ * is live it is written anew.
+ */
+typedef struct {
+  char magic[8]; /* "mtstate\n" */
+  uint32_t version;
+  uint32_t layout; /* sizes of the structures stored as they are */
+} StateFile;
+
+typedef struct {
+  uint32_t tag; /* 'H' or 'S' */
+  uint32_t len; /* of the payload, without the padding */
+  uint64_t sum; /* of the padded payload */
+} StateRecord;
+
+/* an H record: n lines from number first on, each padded to 4 bytes */
+typedef struct {
+  uint64_t first;
+  uint64_t n;
+} StateLines;
+
+typedef struct {
+  MTGlyph attr;
+  int x, y, state;
+} StateCursor;
+
+/*
+ * An S record, followed by the tab stops, the color pairs and the rows of
+ * the screen shown, then those of the other one if it is allocated.
+ */
+typedef struct {
+  uint64_t histfirst; /* number of the oldest line of the history */
+  uint64_t histn;     /* lines in the history */
+  int col, row;
+  StateCursor c, saved[2];
+  int top, bot, mode, charset, icharset, numlock;
+  char trantbl[4];
+  int ncolors;
+  int alt; /* the other screen follows */
+} StateHead;
+
 typedef struct {
   KeySym k;
   uint mask;
@@ -131,6 +311,8 @@ static void printscreen(const Arg *);
 static void iso14755(const Arg *);
 static void toggleprinter(const Arg *);
 static void sendbreak(const Arg *);
+static void kscrollup(const Arg *);
+static void kscrolldown(const Arg *);
 
 /* config.h for applying patches and the configuration. */
 #include "config.h"
@@ -140,13 +322,23 @@ static void sigchld(int);
 
 static void csidump(void);
 static void csihandle(void);
-static void csiparse(void);
+static void csiparam(uchar);
 static void csireset(void);
-static int eschandle(uchar);
+static void eschandle(uchar);
 static void strdump(void);
 static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
+static void strwrite(const char *, size_t);
+static void osc52put(const char *, size_t);
+static void osc52end(void);
+
+static size_t tparse(const char *, size_t);
+static void ttybufgrow(void);
+static void ttybufparse(void);
+
+static void ttyloop(void);
+static void tnotify(void);
 
 static void tprinter(const char *, size_t);
 static void tdumpsel(void);
@@ -159,37 +351,83 @@ static void tdeleteline(int);
 static void tinsertblank(int);
 static void tinsertblankline(int);
 static int tlinelen(int);
+static void tlinescan(Line, int);
 static void tmoveto(int, int);
 static void tmoveato(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(Rune);
+static void tputchar(Rune);
+static int runewidth(Rune);
+static void tcollect(uchar);
+static void tstrput(Rune);
+static void tvtenter(int, Rune);
+static void tvtleave(int);
+static void tputascii(const char *, size_t);
+static size_t asciirun(const char *, size_t);
 static void treset(void);
 static void tresize(int, int);
-static void tscrollup(int, int);
+static void tscrollup(int, int, int);
 static void tscrolldown(int, int);
-static void tsetattr(int *, int);
+static void thistpush(Line);
+static void thistappend(History *, HistLine *);
+static void thistgrow(History *);
+static HistLine *thistalloc(const HistBuf *, HistLine *);
+static void thistreset(HistBuf *);
+static void thistaddrun(HistBuf *, HistRun);
+static void thistencode(HistBuf *, Line);
+static void thistjoin(HistBuf *, const HistLine *);
+static void thistwrap(HistBuf *);
+static void thistunwrap(HistBuf *);
+static void thistline(const HistLine *, Line);
+static int thistcheck(const HistLine *);
+static Line thistview(int, int);
+static void thistclear(void);
+static void thistcut(History *, HistBuf *, int, int, int *, size_t *);
+static void treflow(History *, int, TCursor *, size_t *);
+static int tstatedir(std::string *);
+static void tstateresume(void);
+static char *tstaterecord(std::string *, uint32_t, size_t);
+static void tstatelines(std::string *, size_t);
+static void tstatescreens(std::string *);
+static int tstateapply(const StateRecord *,
+                       const std::vector<const StateRecord *> &);
+static uint64_t tstatesum(const char *, size_t);
+static void tstatewriter(void);
+static int tstatewrite(const std::string &, std::string *, bool);
+static void tscreenresize(TScreen *, int, int, int);
+static void tscreenfree(TScreen *);
+static void tscreenrotate(int, int);
+static ushort tcolor(uint32_t, uint32_t);
+static int tcolorfind(uint32_t, uint32_t);
+static uint32_t tcolorhash(uint32_t, uint32_t);
+static void tcolorinsert(int);
+static void tcolorgrow(void);
+static void tcolorsweep(void);
+static void tsetattr(int *, uint32_t, int);
 static void tsetchar(Rune, MTGlyph *, int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
+static void taltfree(void);
 static void tsetmode(int, int, int *, int);
+static int tmodestate(int, int);
 static void tfulldirt(void);
+static void tscrolldirt(LineDirty *, LineScroll *, int, int, int, int);
 static void techo(Rune);
 static void tcontrolcode(uchar);
 static void tdectest(char);
 static void tdefutf8(char);
-static int32_t tdefcolor(int *, int *, int);
+static int32_t tdefcolor(int *, uint32_t, int *, int);
 static void tdeftran(char);
-static void tstrsequence(uchar);
 
 static void selscroll(int, int);
 static void selsnap(int *, int *, int);
+static int selectedregion(int, int, int, int);
 
 static Rune utf8decodebyte(char, size_t *);
 static char utf8encodebyte(Rune, size_t);
 static size_t utf8validate(Rune *, size_t);
 
-static char *base64dec(const char *);
 
 static ssize_t xwrite(int, const char *, size_t);
 
@@ -197,6 +435,7 @@ static ssize_t xwrite(int, const char *, size_t);
 TermWindow win;
 Term term;
 Selection sel;
+TtyStats ttystats;
 int cmdfd;
 pid_t pid;
 char **opt_cmd = NULL;
@@ -205,13 +444,55 @@ char *opt_embed = NULL;
 char *opt_font = NULL;
 char *opt_io = NULL;
 char *opt_name = NULL;
+char *opt_session = NULL;
 char *opt_title = NULL;
 int oldbutton = 3; /* button event on startup: 3 = release */
 
 static CSIEscape csiescseq;
 static STREscape strescseq;
+static TtyBuf ttybuf;
+static ColorTable colortab;
+static History hist;
+
+/* The history rows in view, decoded once while they stay the same */
+static struct {
+  std::vector<MTGlyph> glyphs; /* view rows of col glyphs */
+  size_t top;                  /* number of the first line in hist.pushed */
+  uint epoch;                  /* hist.epoch then */
+  int view, col;
+} histview;
+
+/* Threaded mode: the reader thread owns cmdfd and the parser */
+static std::mutex termlock;    /* guards term and sel */
+static std::mutex outlock;     /* guards ttyoutq */
+static std::string ttyoutq;    /* input waiting to be written to the pty */
+static int ttyparsing;         /* ttyread() is parsing the ring */
+static int ttywake[2];         /* wakes the reader thread up for writing */
+static int ttynotify[2];       /* tells the X thread there is new output */
+static std::atomic<bool> ttynotified;
+static std::atomic<int> lockwaiters; /* X thread waiting for termlock */
+static bool ttythreaded;
 static int iofd = 1;
 
+/* Saving of the session state, see tstatesave */
+static struct {
+  std::string path;
+  struct timespec last; /* time of the last save */
+  uint64_t bytes;       /* ttystats.bytes then */
+  int col, row;         /* size then */
+  size_t pushed;        /* hist.pushed then */
+  uint epoch;           /* hist.epoch then */
+  size_t filebytes;     /* in the file, written or queued */
+  bool saved;           /* the file holds a state to append to */
+} state;
+static std::mutex statelock; /* guards the writer's queue */
+static std::condition_variable *statecond; /* not destroyed, see tstateopen */
+static std::string stateq;     /* records waiting for the writer */
+static std::string stateqpath; /* the file they go to */
+static bool staterewrite;      /* stateq starts the file over */
+static bool statebusy;         /* the writer has records in hand */
+static bool statelost;         /* a write failed, start over */
+
 static uchar utfbyte[UTF_SIZ + 1] = {0x80, 0, 0xC0, 0xE0, 0xF0};
 static uchar utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
 static Rune utfmin[UTF_SIZ + 1] = {0, 0, 0x80, 0x800, 0x10000};
@@ -323,47 +604,35 @@ size_t utf8validate(Rune *u, size_t i) {
   return i;
 }
 
-static const char base64_digits[] = {
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  62, 0,  0,  0,  63, 52, 53, 54, 55, 56, 57, 58, 59, 60,
-    61, 0,  0,  0,  -1, 0,  0,  0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  10,
-    11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0,  0,  0,  0,
-    0,  0,  26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42,
-    43, 44, 45, 46, 47, 48, 49, 50, 51, 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
-    0,  0,  0,  0,  0,  0,  0,  0};
-
-char *base64dec(const char *src) {
-  size_t in_len = strlen(src);
-  char *result, *dst;
-
-  if (in_len % 4)
-    return NULL;
-  result = dst = xmalloc<char>(in_len / 4 * 3 + 1);
-  while (*src) {
-    int a = base64_digits[(unsigned char)*src++];
-    int b = base64_digits[(unsigned char)*src++];
-    int c = base64_digits[(unsigned char)*src++];
-    int d = base64_digits[(unsigned char)*src++];
-
-    *dst++ = (a << 2) | ((b & 0x30) >> 4);
-    if (c == -1)
-      break;
-    *dst++ = ((b & 0x0f) << 4) | ((c & 0x3c) >> 2);
-    if (d == -1)
-      break;
-    *dst++ = ((c & 0x03) << 6) | d;
-  }
-  *dst = '\0';
-  return result;
+/* digit values, -1 for invalid characters and -2 for the padding */
+typedef struct {
+  int8_t v[256];
+} Base64Table;
+
+constexpr int8_t base64digit(int c) {
+  if (BETWEEN(c, 'A', 'Z'))
+    return c - 'A';
+  if (BETWEEN(c, 'a', 'z'))
+    return c - 'a' + 26;
+  if (BETWEEN(c, '0', '9'))
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return c == '=' ? -2 : -1;
+}
+
+constexpr Base64Table base64build(void) {
+  Base64Table t{};
+
+  for (int c = 0; c < 256; c++)
+    t.v[c] = base64digit(c);
+  return t;
 }
 
+static constexpr Base64Table base64_digits = base64build();
+
 void selinit(void) {
   clock_gettime(CLOCK_MONOTONIC, &sel.tclick1);
   clock_gettime(CLOCK_MONOTONIC, &sel.tclick2);
@@ -389,15 +658,32 @@ int y2row(int y) {
 }
 
 int tlinelen(int y) {
-  int i = term.col;
+  Line line = term.line[y];
+  LineHeader *h = LINEHDR(line);
+  int i = h->len;
 
-  if (term.line[y][i - 1].mode & ATTR_WRAP)
-    return i;
+  if (h->attr & ATTR_WRAP && line[term.col - 1].mode & ATTR_WRAP)
+    return term.col;
 
-  while (i > 0 && term.line[y][i - 1].u == ' ')
+  while (i > 0 && line[i - 1].u == ' ')
     --i;
 
-  return i;
+  return h->len = i;
+}
+
+/*
+ * Recomputes the header of a line of col glyphs from the glyphs.
+ */
+void tlinescan(Line line, int col) {
+  LineHeader *h = LINEHDR(line);
+  int x;
+
+  h->len = h->attr = 0;
+  for (x = 0; x < col; x++) {
+    h->attr |= line[x].mode;
+    if (line[x].u != ' ')
+      h->len = x + 1;
+  }
 }
 
 void selnormalize(void) {
@@ -426,15 +712,38 @@ void selnormalize(void) {
     sel.ne.x = term.col - 1;
 }
 
-int selected(int x, int y) {
-  if (sel.mode == SEL_EMPTY)
+int selected(int x, int y) { return selcontains(&sel, x, y); }
+
+int selcontains(const Selection *s, int x, int y) {
+  if (s->mode == SEL_EMPTY)
     return 0;
 
-  if (sel.type == SEL_RECTANGULAR)
-    return BETWEEN(y, sel.nb.y, sel.ne.y) && BETWEEN(x, sel.nb.x, sel.ne.x);
+  if (s->type == SEL_RECTANGULAR)
+    return BETWEEN(y, s->nb.y, s->ne.y) && BETWEEN(x, s->nb.x, s->ne.x);
+
+  return BETWEEN(y, s->nb.y, s->ne.y) && (y != s->nb.y || x >= s->nb.x) &&
+         (y != s->ne.y || x <= s->ne.x);
+}
 
-  return BETWEEN(y, sel.nb.y, sel.ne.y) && (y != sel.nb.y || x >= sel.nb.x) &&
-         (y != sel.ne.y || x <= sel.ne.x);
+/*
+ * Returns whether any cell of the rectangle x1,y1 - x2,y2 is selected.
+ */
+int selectedregion(int x1, int y1, int x2, int y2) {
+  int ya = MAX(y1, sel.nb.y), yb = MIN(y2, sel.ne.y);
+  int first, last;
+
+  if (sel.mode == SEL_EMPTY || ya > yb)
+    return 0;
+
+  if (sel.type == SEL_RECTANGULAR)
+    return x2 >= sel.nb.x && x1 <= sel.ne.x;
+
+  /* a regular selection takes whole rows but at its ends */
+  first = ya == sel.nb.y ? sel.nb.x : 0;
+  last = yb == sel.ne.y ? sel.ne.x : term.col - 1;
+  if (ya == yb)
+    return x2 >= first && x1 <= last;
+  return yb - ya > 1 || x2 >= first || x1 <= last;
 }
 
 static bool isdelim(Rune u) {
@@ -693,48 +1002,155 @@ void ttynew(void) {
   default:
     close(s);
     cmdfd = m;
+    /* ttyread() drains the pty until it would block */
+    fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
     signal(SIGCHLD, sigchld);
     break;
   }
 }
 
-size_t ttyread(void) {
-  static char buf[BUFSIZ];
-  static int buflen = 0;
-  char *ptr;
-  int charsize; /* size of utf8 char in bytes */
+/*
+ * Parses as much of buf as possible and returns the number of bytes
+ * consumed. Only an incomplete UTF-8 sequence at the end is left over.
+ */
+size_t tparse(const char *buf, size_t buflen) {
+  const char *ptr = buf;
+  size_t charsize; /* size of utf8 char in bytes */
   Rune unicodep;
-  int ret;
-
-  /* append read bytes to unprocessed bytes */
-  if ((ret = read(cmdfd, buf + buflen, LEN(buf) - buflen)) < 0)
-    die("Couldn't read from shell: %s\n", strerror(errno));
-
-  buflen += ret;
-  ptr = buf;
 
-  for (;;) {
-    if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
+  while (buflen > 0) {
+    /* plain text outside of any sequence bypasses tputc() */
+    if (term.esc == 0 && ISPRINTASCII((uchar)*ptr)) {
+      charsize = asciirun(ptr, buflen);
+      tputascii(ptr, charsize);
+    } else if ((term.esc == VT_OSC_STRING || term.esc == VT_DCS_PASSTHROUGH) &&
+               ISPRINTASCII((uchar)*ptr)) {
+      /* and so does the payload of strings, clipboard transfers can be big */
+      charsize = asciirun(ptr, buflen);
+      if (IS_SET(MODE_PRINT))
+        tprinter(ptr, charsize);
+      if (!IS_SET(MODE_SIXEL)) /* TODO: implement sixel mode */
+        strwrite(ptr, charsize);
+    } else if (IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
       /* process a complete utf8 char */
       charsize = utf8decode(ptr, &unicodep, buflen);
       if (charsize == 0)
         break;
       tputc(unicodep);
-      ptr += charsize;
-      buflen -= charsize;
-
     } else {
-      if (buflen <= 0)
+      tputc(*ptr & 0xFF);
+      charsize = 1;
+    }
+    ptr += charsize;
+    buflen -= charsize;
+  }
+
+  return ptr - buf;
+}
+
+void ttybufgrow(void) {
+  size_t used = ttybuf.wr - ttybuf.rd, off, n, i;
+  size_t size = ttybuf.size ? ttybuf.size * 2 : TTYBUF_MIN;
+  char *buf = xmalloc<char>(size);
+
+  /* unwrap the pending bytes to the start of the new buffer */
+  for (i = 0; i < used; i += n) {
+    off = (ttybuf.rd + i) & (ttybuf.size - 1);
+    n = MIN(used - i, ttybuf.size - off);
+    memcpy(buf + i, ttybuf.buf + off, n);
+  }
+  free(ttybuf.buf);
+  ttybuf.buf = buf;
+  ttybuf.size = size;
+  ttybuf.rd = 0;
+  ttybuf.wr = used;
+}
+
+void ttybufparse(void) {
+  size_t mask = ttybuf.size - 1, off, len, n, i;
+  char tmp[UTF_SIZ];
+
+  while (ttybuf.rd != ttybuf.wr) {
+    off = ttybuf.rd & mask;
+    len = MIN(ttybuf.wr - ttybuf.rd, ttybuf.size - off);
+    n = tparse(ttybuf.buf + off, len);
+    ttybuf.rd += n;
+    if (n < len)
+      break;
+  }
+  if (ttybuf.rd == ttybuf.wr || (ttybuf.rd & mask) + UTF_SIZ <= ttybuf.size)
+    return;
+
+  /*
+   * An incomplete character at the end of the ring may be completed by
+   * the bytes at its start: decode it from a copy.
+   */
+  len = MIN(ttybuf.wr - ttybuf.rd, UTF_SIZ);
+  for (i = 0; i < len; i++)
+    tmp[i] = ttybuf.buf[(ttybuf.rd + i) & mask];
+  if ((n = tparse(tmp, len)) > 0) {
+    ttybuf.rd += n;
+    ttybufparse();
+  }
+}
+
+size_t ttyread(void) {
+  struct timespec start, now;
+  size_t total = 0, off, len;
+  ssize_t ret;
+  int drained = 0;
+
+  if (ttybuf.size == 0)
+    ttybufgrow();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!drained) {
+    /* drain the pty into the ring, growing it up to the budget */
+    for (;;) {
+      if (ttybuf.wr - ttybuf.rd == ttybuf.size) {
+        /* the parser holds pointers into the ring while it runs */
+        if (ttyparsing || ttybuf.size >= ttyreadbytes)
+          break;
+        ttybufgrow();
+      }
+      off = ttybuf.wr & (ttybuf.size - 1);
+      len = MIN(ttybuf.size - (ttybuf.wr - ttybuf.rd), ttybuf.size - off);
+      if ((ret = read(cmdfd, ttybuf.buf + off, len)) < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          die("Couldn't read from shell: %s\n", strerror(errno));
+        ret = 0;
+      }
+      if (ret == 0) {
+        drained = 1;
         break;
-      tputc(*ptr++ & 0xFF);
-      buflen--;
+      }
+      ttybuf.wr += ret;
+      total += ret;
     }
+
+    /* a reply written by the parser reads to make room in the pty */
+    if (ttyparsing)
+      break;
+
+    /* incomplete sequences stay in the ring until the next read */
+    ttyparsing = 1;
+    ttybufparse();
+    ttyparsing = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (total >= ttyreadbytes || TIMEDIFF(now, start) >= ttyreadtime)
+      break;
   }
-  /* keep any uncomplete utf8 char for the next call */
-  if (buflen > 0)
-    memmove(buf, ptr, buflen);
 
-  return ret;
+  ttystats.bytes += total;
+  if (!ttyparsing) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ttystats.parsems += TIMEDIFF(now, start);
+    ttyflushq();
+  }
+  return total;
 }
 
 void ttywrite(const char *s, size_t n) {
@@ -742,6 +1158,34 @@ void ttywrite(const char *s, size_t n) {
   ssize_t r;
   size_t lim = 256;
 
+  /*
+   * The reader thread writes as soon as the pty accepts input. Replies
+   * are dropped past the limit below, as without the thread; ttyparsing
+   * only changes under the terminal lock, which writers hold.
+   */
+  if (ttythreaded) {
+    outlock.lock();
+    if (!ttyparsing || ttyoutq.size() + n <= TTYOUTQ_MAX)
+      ttyoutq.append(s, n);
+    outlock.unlock();
+    if (write(ttywake[1], "", 1) < 0 && errno != EAGAIN)
+      die("Couldn't wake up the reader thread: %s\n", strerror(errno));
+    return;
+  }
+
+  /*
+   * Replies written while parsing don't wait for the pty: a program that
+   * doesn't read its input would leave a full ring that nothing drains.
+   * They are queued, up to a limit, and written after the parse. Later
+   * input keeps its place behind them.
+   */
+  if (ttyparsing || ttyqueued()) {
+    std::lock_guard<std::mutex> lock(outlock);
+    if (!ttyparsing || ttyoutq.size() + n <= TTYOUTQ_MAX)
+      ttyoutq.append(s, n);
+    return;
+  }
+
   /*
    * Remember that we are using a pty, which might be a modem line.
    * Writing too much will clog the line. That's why we are doing this
@@ -766,8 +1210,11 @@ void ttywrite(const char *s, size_t n) {
        * default of 256. This seems to be a reasonable value
        * for a serial line. Bigger values might clog the I/O.
        */
-      if ((r = write(cmdfd, s, (n < lim) ? n : lim)) < 0)
-        goto write_error;
+      if ((r = write(cmdfd, s, (n < lim) ? n : lim)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          goto write_error;
+        r = 0;
+      }
       if (r < n) {
         /*
          * We weren't able to write out everything.
@@ -775,7 +1222,7 @@ void ttywrite(const char *s, size_t n) {
          * again. Empty it.
          */
         if (n < lim)
-          lim = ttyread();
+          ttyread();
         n -= r;
         s += r;
       } else {
@@ -784,7 +1231,7 @@ void ttywrite(const char *s, size_t n) {
       }
     }
     if (FD_ISSET(cmdfd, &rfd))
-      lim = ttyread();
+      ttyread();
   }
   return;
 
@@ -792,11 +1239,114 @@ write_error:
   die("write error on tty: %s\n", strerror(errno));
 }
 
+int ttyqueued(void) {
+  std::lock_guard<std::mutex> lock(outlock);
+  return !ttyoutq.empty();
+}
+
+void ttyflushq(void) {
+  ssize_t r;
+
+  std::lock_guard<std::mutex> lock(outlock);
+  while (!ttyoutq.empty()) {
+    if ((r = write(cmdfd, ttyoutq.data(), ttyoutq.size())) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      die("write error on tty: %s\n", strerror(errno));
+    }
+    ttyoutq.erase(0, r);
+  }
+}
+
+void ttyloop(void) {
+  fd_set rfd, wfd;
+  char buf[64];
+  bool pending;
+
+  for (;;) {
+    FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
+    FD_SET(cmdfd, &rfd);
+    FD_SET(ttywake[0], &rfd);
+    outlock.lock();
+    pending = !ttyoutq.empty();
+    outlock.unlock();
+    if (pending)
+      FD_SET(cmdfd, &wfd);
+
+    if (pselect(MAX(cmdfd, ttywake[0]) + 1, &rfd, &wfd, NULL, NULL, NULL) < 0) {
+      if (errno == EINTR)
+        continue;
+      die("select failed: %s\n", strerror(errno));
+    }
+    if (FD_ISSET(ttywake[0], &rfd)) {
+      while (read(ttywake[0], buf, sizeof(buf)) > 0)
+        ;
+      ttyflushq();
+    }
+    if (FD_ISSET(cmdfd, &wfd))
+      ttyflushq();
+    if (FD_ISSET(cmdfd, &rfd)) {
+      /* during a flood, don't snatch the lock back from the X thread */
+      while (lockwaiters > 0)
+        std::this_thread::yield();
+      termlock.lock();
+      ttyread();
+      termlock.unlock();
+      tnotify();
+    }
+  }
+}
+
+int ttystart(void) {
+  int i;
+
+  if (pipe(ttywake) < 0 || pipe(ttynotify) < 0)
+    die("pipe failed: %s\n", strerror(errno));
+  for (i = 0; i < 2; i++) {
+    fcntl(ttywake[i], F_SETFL, fcntl(ttywake[i], F_GETFL) | O_NONBLOCK);
+    fcntl(ttynotify[i], F_SETFL, fcntl(ttynotify[i], F_GETFL) | O_NONBLOCK);
+  }
+  ttythreaded = true;
+  std::thread(ttyloop).detach();
+
+  return ttynotify[0];
+}
+
+void tnotify(void) {
+  if (!ttynotified.exchange(true) && write(ttynotify[1], "", 1) < 0 &&
+      errno != EAGAIN)
+    die("Couldn't notify the X thread: %s\n", strerror(errno));
+}
+
+void ttyack(void) {
+  char buf[64];
+
+  ttynotified = false;
+  while (read(ttynotify[0], buf, sizeof(buf)) > 0)
+    ;
+}
+
+void tlock(void) {
+  lockwaiters++;
+  termlock.lock();
+  lockwaiters--;
+}
+
+void tunlock(void) { termlock.unlock(); }
+
 void ttysend(const char *s, size_t n) {
   int len;
   const char *t, *lim;
   Rune u;
 
+  /* typing returns from the history */
+  if (term.view) {
+    term.view = 0;
+    tfulldirt();
+  }
   ttywrite(s, n);
   if (!IS_SET(MODE_ECHO))
     return;
@@ -827,14 +1377,19 @@ void ttyresize(void) {
     fprintf(stderr, "Couldn't set window size: %s\n", strerror(errno));
 }
 
+/*
+ * The headers rule out most lines. Where they can't, the line is scanned
+ * and its header made exact for the next time.
+ */
 int tattrset(int attr) {
-  int i, j;
+  int i;
 
-  for (i = 0; i < term.row - 1; i++) {
-    for (j = 0; j < term.col - 1; j++) {
-      if (term.line[i][j].mode & attr)
-        return 1;
-    }
+  for (i = 0; i < term.row; i++) {
+    if (!(LINEHDR(term.line[i])->attr & attr))
+      continue;
+    tlinescan(term.line[i], term.col);
+    if (LINEHDR(term.line[i])->attr & attr)
+      return 1;
   }
 
   return 0;
@@ -847,40 +1402,185 @@ void tsetdirt(int top, int bot) {
   LIMIT(bot, 0, term.row - 1);
 
   for (i = top; i <= bot; i++)
-    term.dirty[i] = 1;
+    DIRTYADD(term.dirty[i], 0, term.col - 1);
 }
 
 void tsetdirtattr(int attr) {
-  int i, j;
+  int i;
 
-  for (i = 0; i < term.row - 1; i++) {
-    for (j = 0; j < term.col - 1; j++) {
-      if (term.line[i][j].mode & attr) {
-        tsetdirt(i, i);
-        break;
-      }
-    }
+  for (i = 0; i < term.row; i++) {
+    if (!(LINEHDR(term.line[i])->attr & attr))
+      continue;
+    tlinescan(term.line[i], term.col);
+    if (LINEHDR(term.line[i])->attr & attr)
+      tsetdirt(i, i);
   }
 }
 
 void tfulldirt(void) { tsetdirt(0, term.row - 1); }
 
+/*
+ * Moves the damage of rows top..bot of a col wide screen along with a
+ * scroll by n, and adds the scroll to the pending one in s, so that the
+ * drawn rows can be moved instead of repainted. The rows scrolled in are
+ * damaged entirely. A pending scroll of another region is given up by
+ * damaging that region.
+ */
+void tscrolldirt(LineDirty *dirty, LineScroll *s, int col, int top, int bot,
+                 int n) {
+  int i, len = bot - top + 1;
+
+  if (s->n && (s->top != top || s->bot != bot)) {
+    for (i = s->top; i <= s->bot; i++)
+      DIRTYADD(dirty[i], 0, col - 1);
+    s->n = 0;
+  }
+  if (n >= len || -n >= len) {
+    for (i = top; i <= bot; i++)
+      DIRTYADD(dirty[i], 0, col - 1);
+    s->n = 0;
+    return;
+  }
+
+  std::rotate(dirty + top, dirty + top + (n + len) % len, dirty + bot + 1);
+  for (i = n > 0 ? bot - n + 1 : top; i <= (n > 0 ? bot : top - n - 1); i++)
+    DIRTYADD(dirty[i], 0, col - 1);
+
+  s->top = top;
+  s->bot = bot;
+  s->n += n;
+  /* once everything was scrolled out, nothing drawn is left to move */
+  if (s->n >= len || -s->n >= len)
+    s->n = 0;
+}
+
+/*
+ * Copies what the renderer needs into dst and dsel, which are owned by the
+ * X thread in threaded mode. Only the dirty columns of rows are copied; they
+ * stay dirty in dst until drawn. While the view is in the history, its
+ * rows from thistview go above the screen and every row is copied.
+ */
+void tsnapshot(Term *dst, Selection *dsel) {
+  Line *line = dst->line;
+  MTColor *colors = dst->colors;
+  LineDirty *dirty = dst->dirty, d;
+  LineScroll scroll = dst->scroll, *s = &term.scroll;
+  int y, len, resized = dst->row != term.row || dst->col != term.col;
+  int view = MIN((size_t)term.view, hist.n);
+
+  if (resized) {
+    for (y = 0; y < dst->row; y++)
+      free(line[y]);
+    line = xrealloc<Line>(line, term.row);
+    dirty = xrealloc<LineDirty>(dirty, term.row);
+    for (y = 0; y < term.row; y++) {
+      line[y] = xmalloc<MTGlyph>(term.col);
+      DIRTYCLEAR(dirty[y]);
+    }
+  }
+
+  /* rows scrolled since the last snapshot move along in the copy */
+  if (resized || view) {
+    scroll.n = 0;
+  } else if (s->n) {
+    len = s->bot - s->top + 1;
+    std::rotate(line + s->top, line + s->top + (s->n + len) % len,
+                line + s->bot + 1);
+    tscrolldirt(dirty, &scroll, term.col, s->top, s->bot, s->n);
+  }
+  s->n = 0;
+
+  for (y = 0; y < term.row; y++) {
+    d = term.dirty[y];
+    if (resized || view)
+      d = {0, term.col - 1};
+    else if (!DIRTY(d))
+      continue;
+    if (y < view) {
+      memcpy(line[y], thistview(view, y), term.col * sizeof(MTGlyph));
+    } else {
+      memcpy(line[y] + d.x1, term.line[y - view] + d.x1,
+             (d.x2 - d.x1 + 1) * sizeof(MTGlyph));
+    }
+    DIRTYADD(dirty[y], d.x1, d.x2);
+    DIRTYCLEAR(term.dirty[y]);
+  }
+
+  /* the pairs only change at the end, or where a sweep released them */
+  if (colortab.dirty < term.ncolors) {
+    colors = xrealloc<MTColor>(colors, colortab.size);
+    memcpy(colors + colortab.dirty, term.colors + colortab.dirty,
+           (term.ncolors - colortab.dirty) * sizeof(MTColor));
+    colortab.dirty = term.ncolors;
+  }
+
+  *dst = term;
+  dst->line = line;
+  dst->colors = colors;
+  dst->alt = NULL;
+  dst->scr[0] = dst->scr[1] = {};
+  dst->dirty = dirty;
+  dst->scroll = scroll;
+  dst->tabs = NULL;
+
+  *dsel = sel;
+  dsel->primary = dsel->clipboard = NULL;
+
+  /* the cursor may be pushed off the bottom of the view */
+  if (view && (dst->c.y += view) >= dst->row) {
+    dst->c.y = dst->row - 1;
+    dst->mode |= MODE_HIDE;
+  }
+}
+
+/*
+ * Frees the alternate screen once it has been left for altscreentimeout
+ * seconds. Returns the milliseconds until that is due, -1 if it isn't.
+ */
+long taltidle(const struct timespec *now) {
+  long left;
+
+  if (!altscreentimeout || !term.alt || IS_SET(MODE_ALTSCREEN))
+    return -1;
+  left = altscreentimeout * 1000L - TIMEDIFF((*now), term.altleft);
+  if (left > 0)
+    return left;
+  taltfree();
+  return -1;
+}
+
+void taltfree(void) {
+  tscreenfree(&term.scr[1]);
+  term.alt = NULL;
+}
+
+/* whether a synchronized update still holds drawing back */
+int tsyncing(void) {
+  struct timespec now;
+
+  if (!IS_SET(MODE_SYNC))
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return TIMEDIFF(now, term.synctime) < synctimeout;
+}
+
 void tcursor(int mode) {
-  static TCursor c[2];
   int alt = IS_SET(MODE_ALTSCREEN);
 
   if (mode == CURSOR_SAVE) {
-    c[alt] = term.c;
+    term.saved[alt] = term.c;
   } else if (mode == CURSOR_LOAD) {
-    term.c = c[alt];
-    tmoveto(c[alt].x, c[alt].y);
+    term.c = term.saved[alt];
+    tmoveto(term.saved[alt].x, term.saved[alt].y);
   }
 }
 
 void treset(void) {
   uint i;
 
-  term.c = TCursor{MTGlyph{/* rune */ 0, ATTR_NULL, defaultfg, defaultbg},
+  if (IS_SET(MODE_ALTSCREEN))
+    tswapscreen();
+  term.c = TCursor{MTGlyph{/* rune */ 0, ATTR_NULL, /* color */ 0},
                    /* x */ 0,
                    /* y */ 0, CURSOR_DEFAULT};
 
@@ -894,75 +1594,1143 @@ void treset(void) {
   memset(term.trantbl, CS_USA, sizeof(term.trantbl));
   term.charset = 0;
 
-  for (i = 0; i < 2; i++) {
-    tmoveto(0, 0);
-    tcursor(CURSOR_SAVE);
-    tclearregion(0, 0, term.col - 1, term.row - 1);
-    tswapscreen();
-  }
+  tmoveto(0, 0);
+  term.saved[0] = term.saved[1] = term.c;
+  tclearregion(0, 0, term.col - 1, term.row - 1);
+  tfulldirt();
+  /* the alternate screen comes back blank when it is next used */
+  taltfree();
 }
 
 void tnew(int col, int row) {
   term = {};
-  term.c.attr = {/* rune */ 0, ATTR_NULL, defaultfg, defaultbg};
+  tcolorgrow();
+  /* the default colors are the first pair, no sweep releases it */
+  term.c.attr = {/* rune */ 0, ATTR_NULL, tcolor(defaultfg, defaultbg)};
   tresize(col, row);
   term.numlock = 1;
 
   treset();
 }
 
+/*
+ * The alternate screen is only allocated when it is first entered, and
+ * taltidle frees it again some time after it was left.
+ */
 void tswapscreen(void) {
-  Line *tmp = term.line;
+  Line *tmp;
 
+  if (!term.alt) {
+    tscreenresize(&term.scr[1], 0, term.col, term.row);
+    term.alt = term.scr[1].ring;
+  }
+  if (IS_SET(MODE_ALTSCREEN))
+    clock_gettime(CLOCK_MONOTONIC, &term.altleft);
+
+  tmp = term.line;
   term.line = term.alt;
   term.alt = tmp;
+  std::swap(term.scr[0], term.scr[1]);
   term.mode ^= MODE_ALTSCREEN;
+  term.view = 0;
   tfulldirt();
 }
 
-void tscrolldown(int orig, int n) {
-  int i;
-  Line temp;
-
-  LIMIT(n, 0, term.bot - orig + 1);
+/*
+ * Reallocates scr as a col x row slab, keeping what fits of its rows
+ * from first on; the rest is blank. The rows come out in screen order at
+ * head 0.
+ */
+void tscreenresize(TScreen *scr, int first, int col, int row) {
+  Line *old = scr->ring ? scr->ring + scr->head : NULL;
+  size_t size = row * (col + 1) * sizeof(MTGlyph);
+  MTGlyph *cells;
+  Line *ring = xmalloc<Line>(2 * row);
+  int x, y;
 
-  tsetdirt(orig, term.bot - n);
-  tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+  cells = (MTGlyph *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (cells == MAP_FAILED)
+    die("Out of memory\n");
 
-  for (i = term.bot; i >= orig + n; i--) {
-    temp = term.line[i];
-    term.line[i] = term.line[i - n];
-    term.line[i - n] = temp;
+  for (y = 0; y < row; y++) {
+    ring[y] = ring[y + row] = cells + y * (col + 1) + 1;
+    *LINEHDR(ring[y]) = {0, 0};
+    x = 0;
+    if (old && first + y < term.row) {
+      x = MIN(col, term.col);
+      memcpy(ring[y], old[first + y], x * sizeof(MTGlyph));
+      *LINEHDR(ring[y]) = *LINEHDR(old[first + y]);
+      LINEHDR(ring[y])->len = MIN(LINEHDR(ring[y])->len, col);
+    }
+    std::fill(ring[y] + x, ring[y] + col, MTGlyph{' ', ATTR_NULL, 0});
   }
+  tscreenfree(scr);
+  *scr = {cells, ring, 0, size};
+}
 
-  selscroll(orig, n);
+/*
+ * Unmaps the slab of scr. A slab from malloc would mostly stay in the
+ * process after free(), as it sits below younger allocations.
+ */
+void tscreenfree(TScreen *scr) {
+  if (scr->cells)
+    munmap(scr->cells, scr->size);
+  free(scr->ring);
+  *scr = {};
 }
 
-void tscrollup(int orig, int n) {
-  int i;
-  Line temp;
+/*
+ * Rotates rows orig..term.bot of the screen up by n rows, or down when n
+ * is negative. Scrolling the whole screen only moves the head of the ring,
+ * a region shifts its row pointers and mirrors them.
+ */
+void tscreenrotate(int orig, int n) {
+  TScreen *scr = &term.scr[0];
+  int i, k, len = term.bot - orig + 1;
 
-  LIMIT(n, 0, term.bot - orig + 1);
+  if (orig == 0 && len == term.row) {
+    scr->head = (scr->head + n + term.row) % term.row;
+    term.line = scr->ring + scr->head;
+    return;
+  }
 
-  tclearregion(0, orig, term.col - 1, orig + n - 1);
-  tsetdirt(orig + n, term.bot);
+  std::rotate(term.line + orig, term.line + orig + (n + len) % len,
+              term.line + term.bot + 1);
+  for (i = orig; i <= term.bot; i++) {
+    k = scr->head + i;
+    scr->ring[k < term.row ? k + term.row : k - term.row] = term.line[i];
+  }
+}
 
-  for (i = orig; i <= term.bot - n; i++) {
-    temp = term.line[i];
-    term.line[i] = term.line[i + n];
-    term.line[i + n] = temp;
+/*
+ * Returns the index of the fg, bg pair in term.colors, adding it when it
+ * is new. Once all indices are taken the pairs no glyph uses any more are
+ * released; if that frees none, the pair is drawn in the default colors.
+ */
+ushort tcolor(uint32_t fg, uint32_t bg) {
+  int n;
+
+  if ((n = tcolorfind(fg, bg)) >= 0)
+    return n;
+
+  /* after a sweep that freed little the next one waits a while */
+  if (!colortab.nfree && term.ncolors == COLOR_MAX &&
+      --colortab.sweepwait <= 0)
+    tcolorsweep();
+  if (colortab.nfree) {
+    n = colortab.free[--colortab.nfree];
+  } else if (term.ncolors < COLOR_MAX) {
+    if (term.ncolors == colortab.size)
+      tcolorgrow();
+    n = term.ncolors++;
+  } else {
+    return 0;
   }
 
-  selscroll(orig, -n);
+  term.colors[n] = {fg, bg};
+  tcolorinsert(n);
+  colortab.dirty = MIN(colortab.dirty, n);
+  return n;
 }
 
-void selscroll(int orig, int n) {
-  if (sel.ob.x == -1)
-    return;
+/* returns the index of the pair, or -1 when it isn't in the table */
+int tcolorfind(uint32_t fg, uint32_t bg) {
+  uint32_t h, i;
 
-  if (BETWEEN(sel.ob.y, orig, term.bot) || BETWEEN(sel.oe.y, orig, term.bot)) {
-    if ((sel.ob.y += n) > term.bot || (sel.oe.y += n) < term.top) {
-      selclear();
+  for (h = tcolorhash(fg, bg);; h++) {
+    if (!(i = colortab.hash[h & (2 * colortab.size - 1)]))
+      return -1;
+    if (term.colors[i - 1].fg == fg && term.colors[i - 1].bg == bg)
+      return i - 1;
+  }
+}
+
+uint32_t tcolorhash(uint32_t fg, uint32_t bg) {
+  uint32_t h = fg * 0x9e3779b1u ^ bg * 0x85ebca77u;
+
+  return h ^ h >> 16;
+}
+
+void tcolorinsert(int n) {
+  uint32_t h = tcolorhash(term.colors[n].fg, term.colors[n].bg);
+
+  while (colortab.hash[h & (2 * colortab.size - 1)])
+    h++;
+  colortab.hash[h & (2 * colortab.size - 1)] = n + 1;
+}
+
+/* doubles the capacity of the table and rehashes its pairs */
+void tcolorgrow(void) {
+  int n;
+
+  colortab.size = colortab.size ? 2 * colortab.size : COLOR_MIN;
+  term.colors = xrealloc<MTColor>(term.colors, colortab.size);
+  free(colortab.hash);
+  colortab.hash = (uint32_t *)calloc(2 * colortab.size, sizeof(uint32_t));
+  if (!colortab.hash)
+    die("Out of memory\n");
+  for (n = 0; n < term.ncolors; n++) {
+    if (term.colors[n].fg != COLOR_FREE)
+      tcolorinsert(n);
+  }
+}
+
+/*
+ * Releases the pairs that no glyph on either screen or in view in the
+ * history and no cursor refers to. The other pairs keep their index, so
+ * nothing needs to be rewritten.
+ */
+void tcolorsweep(void) {
+  std::vector<bool> used(term.ncolors);
+  HistLine *line;
+  size_t h;
+  int i, n, x, y;
+
+  used[0] = true;
+  used[term.c.attr.color] = true;
+  for (i = 0; i < 2; i++) {
+    used[term.saved[i].attr.color] = true;
+    /* the alternate screen may not be allocated */
+    for (y = 0; term.scr[i].ring && y < term.row; y++) {
+      for (x = 0; x < term.col; x++)
+        used[term.scr[i].ring[y][x].color] = true;
+    }
+  }
+  /* and the history lines in view, which the renderer may be showing */
+  for (h = hist.n - MIN((size_t)term.view, hist.n); h < hist.n; h++) {
+    line = HISTLINE(hist, h);
+    for (i = 0; i < line->nrun; i++) {
+      if ((n = tcolorfind(HISTRUNS(line)[i].fg, HISTRUNS(line)[i].bg)) >= 0)
+        used[n] = true;
+    }
+  }
+
+  if (!colortab.free)
+    colortab.free = xmalloc<ushort>(COLOR_MAX);
+  memset(colortab.hash, 0, 2 * colortab.size * sizeof(uint32_t));
+  for (n = 0; n < term.ncolors; n++) {
+    if (used[n]) {
+      tcolorinsert(n);
+    } else if (term.colors[n].fg != COLOR_FREE) {
+      term.colors[n] = {COLOR_FREE, COLOR_FREE};
+      colortab.free[colortab.nfree++] = n;
+    }
+  }
+  colortab.sweepwait = colortab.nfree < COLOR_MAX / 16 ? COLOR_MAX / 16 : 0;
+}
+
+/*
+ * Moves a line leaving the top of the screen into the history. The oldest
+ * lines go once histlines or histmegabytes would be exceeded, the memory
+ * of the first one is reused for the new line.
+ */
+void thistpush(Line line) {
+  static HistBuf buf;
+  HistLine *old, *reuse = NULL;
+  size_t size, limit = (size_t)histmegabytes << 20;
+
+  if (!histlines)
+    return;
+  thistreset(&buf);
+  thistencode(&buf, line);
+  size = HISTSIZE(buf.runs.size(), buf.text.size());
+
+  while (hist.n && (hist.n >= histlines ||
+                    (limit && hist.bytes + size > limit))) {
+    old = HISTLINE(hist, 0);
+    hist.bytes -= old->size;
+    if (reuse)
+      free(old);
+    else
+      reuse = old;
+    hist.first = (hist.first + 1) & (hist.size - 1);
+    hist.n--;
+  }
+  thistappend(&hist, thistalloc(&buf, reuse));
+
+  /* a view into the history stays on the lines it shows */
+  if (term.view)
+    term.view = MIN((size_t)term.view + 1, hist.n);
+}
+
+void thistappend(History *h, HistLine *hl) {
+  if (h->n == h->size)
+    thistgrow(h);
+  HISTLINE(*h, h->n++) = hl;
+  h->bytes += hl->size;
+  h->pushed++;
+}
+
+void thistgrow(History *h) {
+  size_t i, size = h->size ? 2 * h->size : HIST_MIN;
+  HistLine **line = xmalloc<HistLine *>(size);
+
+  for (i = 0; i < h->n; i++)
+    line[i] = HISTLINE(*h, i);
+  free(h->line);
+  h->line = line;
+  h->size = size;
+  h->first = 0;
+}
+
+HistLine *thistalloc(const HistBuf *b, HistLine *reuse) {
+  size_t size = HISTSIZE(b->runs.size(), b->text.size());
+  HistLine *hl = reinterpret_cast<HistLine *>(xrealloc<char>(reuse, size));
+
+  hl->size = size;
+  hl->nrun = b->runs.size();
+  memcpy(HISTRUNS(hl), b->runs.data(), b->runs.size() * sizeof(HistRun));
+  memcpy(HISTRUNS(hl) + hl->nrun, b->text.data(), b->text.size());
+  return hl;
+}
+
+void thistreset(HistBuf *b) {
+  b->runs.clear();
+  b->text.clear();
+  b->cols = 0;
+}
+
+/* appends a run to b, extending its last run when the attributes match */
+void thistaddrun(HistBuf *b, HistRun r) {
+  HistRun *last = b->runs.empty() ? NULL : &b->runs.back();
+
+  b->cols += r.len * (r.mode & ATTR_WIDE ? 2 : 1);
+  if (last && last->mode == r.mode && last->fg == r.fg && last->bg == r.bg &&
+      last->len + r.len <= USHRT_MAX) {
+    last->len += r.len;
+  } else {
+    b->runs.push_back(r);
+  }
+}
+
+/* appends the glyphs of a screen row to b, without its trailing blanks */
+void thistencode(HistBuf *b, Line line) {
+  size_t ntext = b->text.size();
+  MTColor *c;
+  char *text;
+  int x, len, prev = -1;
+
+  for (len = term.col; len > 0 && ISBLANKGLYPH(line[len - 1]); len--)
+    ;
+  b->text.resize(ntext + len * UTF_SIZ);
+  text = &b->text[ntext];
+  for (x = 0; x < len; x++) {
+    if (line[x].mode & ATTR_WDUMMY)
+      continue;
+    /* a glyph like the one before extends its run without a color lookup */
+    if (prev >= 0 && !ATTRCMP(line[prev], line[x]) &&
+        b->runs.back().len < USHRT_MAX) {
+      b->runs.back().len++;
+      b->cols += line[x].mode & ATTR_WIDE ? 2 : 1;
+    } else {
+      c = &term.colors[line[x].color];
+      thistaddrun(b, {1, line[x].mode, c->fg, c->bg});
+    }
+    prev = x;
+    if (line[x].u < 0x80)
+      *text++ = line[x].u;
+    else
+      text += utf8encode(line[x].u, text);
+  }
+  b->text.resize(text - b->text.data());
+}
+
+/* appends a line of the history to b */
+void thistjoin(HistBuf *b, const HistLine *hl) {
+  const HistRun *run = HISTRUNS(hl);
+  const char *text = reinterpret_cast<const char *>(run + hl->nrun);
+  int i;
+
+  for (i = 0; i < hl->nrun; i++)
+    thistaddrun(b, run[i]);
+  b->text.append(text, reinterpret_cast<const char *>(hl) + hl->size - text);
+}
+
+/* marks the last glyph of b as wrapped onto the next row */
+void thistwrap(HistBuf *b) {
+  HistRun r = b->runs.back();
+
+  if (r.len == 1) {
+    b->runs.back().mode |= ATTR_WRAP;
+  } else {
+    b->runs.back().len--;
+    r.len = 1;
+    r.mode |= ATTR_WRAP;
+    b->runs.push_back(r);
+  }
+}
+
+/* joins the last glyph of b to whatever follows, undoing thistwrap() */
+void thistunwrap(HistBuf *b) {
+  HistRun r;
+
+  if (b->runs.empty() || !(b->runs.back().mode & ATTR_WRAP))
+    return;
+  r = b->runs.back();
+  b->runs.pop_back();
+  b->cols -= r.len * (r.mode & ATTR_WIDE ? 2 : 1);
+  r.mode &= ~ATTR_WRAP;
+  thistaddrun(b, r);
+}
+
+/* decodes a line of the history into term.col glyphs */
+void thistline(const HistLine *hl, Line dst) {
+  const HistRun *run = HISTRUNS(hl);
+  const char *text = reinterpret_cast<const char *>(run + hl->nrun);
+  int r, k, x = 0;
+  ushort color;
+  Rune u;
+
+  for (r = 0; r < hl->nrun; r++) {
+    color = tcolor(run[r].fg, run[r].bg);
+    for (k = 0; k < run[r].len && x < term.col; k++) {
+      text += utf8decode(text, &u, UTF_SIZ);
+      dst[x++] = {u, run[r].mode, color};
+      if (run[r].mode & ATTR_WIDE && x < term.col)
+        dst[x++] = {0, ATTR_WDUMMY, color};
+    }
+  }
+  for (; x < term.col; x++)
+    dst[x] = {' ', ATTR_NULL, 0};
+}
+
+/*
+ * Whether a line read back from a file is one that could have been
+ * stored: its text is exactly one well formed rune per glyph of its runs.
+ */
+int thistcheck(const HistLine *hl) {
+  const HistRun *run = HISTRUNS(hl);
+  const char *text, *end;
+  char buf[UTF_SIZ];
+  size_t glyphs, n;
+  Rune u;
+  int r;
+
+  if (hl->size < HISTSIZE(hl->nrun, 0))
+    return 0;
+  for (r = 0, glyphs = 0; r < hl->nrun; r++)
+    glyphs += run[r].len;
+  text = reinterpret_cast<const char *>(run + hl->nrun);
+  end = reinterpret_cast<const char *>(hl) + hl->size;
+  for (; glyphs > 0 && text < end; glyphs--, text += n) {
+    /* past ASCII, utf8encode writes the one encoding thistencode did */
+    n = 1;
+    if ((uchar)*text < 0x80)
+      continue;
+    n = utf8decode(text, &u, end - text);
+    if (!n || utf8encode(u, buf) != n || memcmp(buf, text, n))
+      return 0;
+  }
+  return !glyphs && text == end;
+}
+
+/*
+ * Returns row y of a view that shows the last view lines of the history.
+ * The rows are decoded again only when the view moves to other lines, so
+ * that frames drawn while scrolled back don't intern their colors anew.
+ */
+Line thistview(int view, int y) {
+  size_t top = hist.pushed - view;
+  int i;
+
+  if (histview.top != top || histview.epoch != hist.epoch ||
+      histview.view != view || histview.col != term.col) {
+    histview.glyphs.resize((size_t)view * term.col);
+    for (i = 0; i < view; i++)
+      thistline(HISTLINE(hist, hist.n - view + i),
+                &histview.glyphs[(size_t)i * term.col]);
+    histview.top = top;
+    histview.epoch = hist.epoch;
+    histview.view = view;
+    histview.col = term.col;
+  }
+  return &histview.glyphs[(size_t)y * term.col];
+}
+
+void thistclear(void) {
+  for (; hist.n > 0; hist.n--)
+    free(HISTLINE(hist, hist.n - 1));
+  hist.bytes = 0;
+  hist.epoch++;
+  if (term.view) {
+    term.view = 0;
+    tfulldirt();
+  }
+}
+
+/*
+ * Cuts the logical line in b into rows of col columns appended to h and
+ * empties b. Every row but the last ends in ATTR_WRAP; a wide glyph that
+ * doesn't fit starts the next row. When pos isn't negative, *x and *y
+ * return where that column of the line lands, the end of the last row if
+ * it is the end of the text.
+ */
+void thistcut(History *h, HistBuf *b, int col, int pos, int *x, size_t *y) {
+  static HistBuf row;
+  const char *text = b->text.data(), *end;
+  int k, n, w, left, start = 0;
+  size_t i;
+  HistRun r;
+  Rune u;
+
+  thistreset(&row);
+  for (i = 0; i < b->runs.size(); i++) {
+    r = b->runs[i];
+    w = r.mode & ATTR_WIDE ? 2 : 1;
+    for (left = r.len; left > 0; left -= k) {
+      /* a row takes at least one glyph, however wide */
+      k = MIN(left, MAX(col - row.cols, 0) / w);
+      if (!row.cols)
+        k = MAX(k, 1);
+      if (!k) {
+        if (pos >= start && pos < start + row.cols) {
+          *x = pos - start;
+          *y = h->n;
+          pos = -1;
+        }
+        start += row.cols;
+        thistwrap(&row);
+        thistappend(h, thistalloc(&row, NULL));
+        thistreset(&row);
+        continue;
+      }
+      for (end = text, n = k; n > 0; n--)
+        end += utf8decode(end, &u, UTF_SIZ);
+      thistaddrun(&row, {(ushort)k, r.mode, r.fg, r.bg});
+      row.text.append(text, end - text);
+      text = end;
+    }
+  }
+  if (pos >= start) {
+    *x = pos - start;
+    *y = h->n;
+  }
+  thistappend(h, thistalloc(&row, NULL));
+  thistreset(b);
+}
+
+/*
+ * Rewraps the history and the primary screen into rows of col columns,
+ * following the soft wraps ATTR_WRAP records, and empties the history.
+ * The cursor c of the primary screen gets its column in the new rows, and
+ * *cy its index in rows. Time and memory are linear in the text.
+ */
+void treflow(History *rows, int col, TCursor *c, size_t *cy) {
+  static HistBuf line;
+  Line *screen = IS_SET(MODE_ALTSCREEN) ? term.alt : term.line;
+  int x, y, cx, last, width, wrapped, pos = -1;
+  const HistRun *run;
+  HistLine *hl;
+  size_t h;
+
+  thistreset(&line);
+  for (h = 0; h < hist.n; h++) {
+    hl = HISTLINE(hist, h);
+    run = HISTRUNS(hl);
+    for (x = width = 0; x < hl->nrun; x++)
+      width += run[x].len * (run[x].mode & ATTR_WIDE ? 2 : 1);
+    wrapped = hl->nrun && run[hl->nrun - 1].mode & ATTR_WRAP;
+
+    /* most lines end on their own and still fit, those stay as they are */
+    if (line.runs.empty() && !wrapped && width <= col) {
+      thistappend(rows, hl);
+      continue;
+    }
+    thistunwrap(&line);
+    thistjoin(&line, hl);
+    free(hl);
+    if (!wrapped)
+      thistcut(rows, &line, col, -1, NULL, NULL);
+  }
+  hist.n = hist.first = hist.bytes = 0;
+
+  /* the blank rows below the cursor hold nothing to keep */
+  c->x = MIN(c->x, term.col - 1);
+  c->y = MIN(c->y, term.row - 1);
+  for (last = term.row - 1; last > c->y; last--) {
+    for (x = 0; x < term.col && ISBLANKGLYPH(screen[last][x]); x++)
+      ;
+    if (x < term.col)
+      break;
+  }
+
+  for (y = 0; y <= last; y++) {
+    thistunwrap(&line);
+    if (y == c->y) {
+      /* with a wrap pending, follow the last column of the glyph */
+      cx = c->x;
+      if (c->state & CURSOR_WRAPNEXT && screen[y][cx].mode & ATTR_WIDE)
+        cx++;
+      pos = line.cols + cx;
+    }
+    thistencode(&line, screen[y]);
+    if (y < last && !line.runs.empty() && line.runs.back().mode & ATTR_WRAP)
+      continue;
+
+    thistunwrap(&line);
+    if (pos < 0) {
+      thistcut(rows, &line, col, -1, NULL, NULL);
+      continue;
+    }
+
+    /* blanks up to the cursor keep it on the rows of its line */
+    width = pos + !!(c->state & CURSOR_WRAPNEXT) - line.cols;
+    if (width > 0) {
+      thistaddrun(&line, {(ushort)width, ATTR_NULL, term.colors[0].fg,
+                          term.colors[0].bg});
+      line.text.append(width, ' ');
+    }
+    thistcut(rows, &line, col, pos, &x, cy);
+    pos = -1;
+
+    /* past the last column a wrap is pending, as after printing there */
+    if (c->state & CURSOR_WRAPNEXT)
+      x++;
+    if (x >= col) {
+      c->x = col - 1;
+      c->state |= CURSOR_WRAPNEXT;
+    } else {
+      c->x = x;
+      c->state &= ~CURSOR_WRAPNEXT;
+    }
+  }
+}
+
+/*
+ * Names the state file of a session, the session itself when it is a
+ * path and a file of statedir otherwise. The state saved there is
+ * restored, and the next tstatesave starts the file over.
+ */
+void tstateopen(const char *session) {
+  std::string dir;
+
+  tstatesync();
+  state.path.clear();
+  if (strchr(session, '/')) {
+    state.path = session;
+  } else if (tstatedir(&dir) == 0) {
+    state.path = dir + "/mt-" + session + ".state";
+  } else {
+    fprintf(stderr, "tstateopen: no directory for session %s\n", session);
+    return;
+  }
+  state.saved = false;
+  if (tstateload(state.path.c_str()) == 0)
+    tstateresume();
+  /* the writer waits on it until exit, it mustn't be destroyed before */
+  if (!statecond) {
+    statecond = new std::condition_variable;
+    std::thread(tstatewriter).detach();
+  }
+}
+
+/*
+ * Names the directory of session files: statedir, $XDG_RUNTIME_DIR, or
+ * mt in $XDG_STATE_HOME or ~/.local/state, made 0700 if it is missing.
+ * Never a shared one like /tmp, where others could plant the files.
+ * Returns -1 when there is none that belongs to the user.
+ */
+int tstatedir(std::string *dir) {
+  const char *env;
+  struct stat st;
+  size_t i;
+
+  if ((env = statedir) || ((env = getenv("XDG_RUNTIME_DIR")) && *env)) {
+    *dir = env;
+    return 0;
+  }
+  if ((env = getenv("XDG_STATE_HOME")) && *env)
+    *dir = std::string(env) + "/mt";
+  else if ((env = getenv("HOME")) && *env)
+    *dir = std::string(env) + "/.local/state/mt";
+  else
+    return -1;
+
+  for (i = 1; (i = dir->find('/', i)) != std::string::npos; i++)
+    mkdir(dir->substr(0, i).c_str(), 0700);
+  mkdir(dir->c_str(), 0700);
+  if (lstat(dir->c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || st.st_mode & (S_IWGRP | S_IWOTH))
+    return -1;
+  return 0;
+}
+
+/*
+ * The program that drew a restored screen is gone: its alternate screen,
+ * modes and attributes go, and the new one starts on a line of its own
+ * below what was there.
+ */
+void tstateresume(void) {
+  if (IS_SET(MODE_ALTSCREEN)) {
+    tswapscreen();
+    tcursor(CURSOR_LOAD);
+  }
+  taltfree();
+  term.mode = MODE_WRAP | MODE_UTF8;
+  term.c.attr = {/* rune */ 0, ATTR_NULL, /* color */ 0};
+  term.c.state = CURSOR_DEFAULT;
+  memset(term.trantbl, CS_USA, sizeof(term.trantbl));
+  term.charset = 0;
+  tsetscroll(0, term.row - 1);
+  if (term.c.x || tlinelen(term.c.y))
+    tnewline(1);
+  term.saved[0] = term.saved[1] = term.c;
+}
+
+/*
+ * Saves the state once it changed and stateinterval milliseconds went by
+ * since the last save. The records are made here, under the lock, and
+ * written by the writer thread: the history lines pushed since the last
+ * save and the rest of the state, or everything when the file is started
+ * over. Returns the milliseconds until a save is due, -1 if none is.
+ */
+long tstatesave(const struct timespec *now) {
+  static std::string rec;
+  size_t live, from;
+  long left;
+  bool full;
+
+  if (state.path.empty() ||
+      (state.saved && state.bytes == ttystats.bytes &&
+       state.col == term.col && state.row == term.row &&
+       state.epoch == hist.epoch))
+    return -1;
+  left = stateinterval - TIMEDIFF((*now), state.last);
+  if (state.saved && left > 0)
+    return left;
+
+  live = hist.bytes + 2 * sizeof(MTGlyph) * term.row * term.col;
+  {
+    std::lock_guard<std::mutex> lock(statelock);
+    full = !state.saved || statelost || state.epoch != hist.epoch ||
+           state.filebytes > 2 * live + (1 << 20);
+    statelost = false;
+  }
+  from = full ? 0 : hist.n - MIN(hist.n, hist.pushed - state.pushed);
+
+  /* the lines go first, a state is never written before its history */
+  rec.clear();
+  tstatelines(&rec, from);
+  tstatescreens(&rec);
+  state.filebytes = (full ? sizeof(StateFile) : state.filebytes) + rec.size();
+  {
+    std::lock_guard<std::mutex> lock(statelock);
+    if (full) {
+      stateq.swap(rec);
+      staterewrite = true;
+    } else {
+      stateq += rec;
+    }
+    stateqpath = state.path;
+    statecond->notify_all();
+  }
+
+  state.last = *now;
+  state.bytes = ttystats.bytes;
+  state.col = term.col;
+  state.row = term.row;
+  state.pushed = hist.pushed;
+  state.epoch = hist.epoch;
+  state.saved = true;
+  return -1;
+}
+
+/* waits until the writer thread wrote all that was saved */
+void tstatesync(void) {
+  std::unique_lock<std::mutex> lock(statelock);
+
+  if (statecond)
+    statecond->wait(lock, [] { return stateq.empty() && !statebusy; });
+}
+
+/* appends a record of len bytes to s and returns them, zeroed */
+char *tstaterecord(std::string *s, uint32_t tag, size_t len) {
+  StateRecord r = {tag, (uint32_t)len, /* sum, by the writer */ 0};
+  size_t off = s->size();
+
+  s->resize(off + sizeof(r) + STATE_ALIGN(len));
+  memcpy(&(*s)[off], &r, sizeof(r));
+  return &(*s)[off + sizeof(r)];
+}
+
+/* appends the history lines from from on as H records */
+void tstatelines(std::string *s, size_t from) {
+  StateLines head;
+  HistLine *hl, h;
+  size_t i, n, len;
+  char *p;
+
+  while (from < hist.n) {
+    len = sizeof(head);
+    for (n = 0; from + n < hist.n && len < STATE_CHUNK; n++)
+      len += (HISTLINE(hist, from + n)->size + 3) & ~3;
+    head = {hist.pushed - hist.n + from, n};
+    p = tstaterecord(s, 'H', len);
+    memcpy(p, &head, sizeof(head));
+    for (p += sizeof(head), i = 0; i < n; i++) {
+      hl = HISTLINE(hist, from + i);
+      /* the padding of the header, thistalloc leaves it as it was */
+      memset(&h, 0, sizeof(h));
+      h.size = hl->size;
+      h.nrun = hl->nrun;
+      memcpy(p, &h, sizeof(h));
+      memcpy(p + sizeof(h), hl + 1, hl->size - sizeof(h));
+      p += (hl->size + 3) & ~3;
+    }
+    from += n;
+  }
+}
+
+/* appends the S record of the terminal and the history it holds */
+void tstatescreens(std::string *s) {
+  const TCursor *c[] = {&term.c, &term.saved[0], &term.saved[1]};
+  int i, y, alt = term.alt != NULL;
+  size_t len = sizeof(StateHead) + term.col * sizeof(*term.tabs) +
+               term.ncolors * sizeof(MTColor) +
+               (1 + alt) * term.row * term.col * sizeof(MTGlyph);
+  StateHead head;
+  StateCursor *sc[] = {&head.c, &head.saved[0], &head.saved[1]};
+  char *p;
+
+  memset(&head, 0, sizeof(head));
+  head.histfirst = hist.pushed - hist.n;
+  head.histn = hist.n;
+  head.col = term.col;
+  head.row = term.row;
+  for (i = 0; i < LEN(c); i++)
+    *sc[i] = {c[i]->attr, c[i]->x, c[i]->y, c[i]->state};
+  head.top = term.top;
+  head.bot = term.bot;
+  head.mode = term.mode;
+  head.charset = term.charset;
+  head.icharset = term.icharset;
+  head.numlock = term.numlock;
+  memcpy(head.trantbl, term.trantbl, sizeof(head.trantbl));
+  head.ncolors = term.ncolors;
+  head.alt = alt;
+
+  p = tstaterecord(s, 'S', len);
+  memcpy(p, &head, sizeof(head));
+  p += sizeof(head);
+  memcpy(p, term.tabs, term.col * sizeof(*term.tabs));
+  p += term.col * sizeof(*term.tabs);
+  memcpy(p, term.colors, term.ncolors * sizeof(MTColor));
+  p += term.ncolors * sizeof(MTColor);
+  for (i = 0; i <= alt; i++) {
+    for (y = 0; y < term.row; y++) {
+      memcpy(p, (i ? term.alt : term.line)[y], term.col * sizeof(MTGlyph));
+      p += term.col * sizeof(MTGlyph);
+    }
+  }
+}
+
+/*
+ * Restores the state saved in the file at path. Returns -1, with the
+ * terminal left as it was, when the file holds no intact state.
+ */
+int tstateload(const char *path) {
+  std::vector<const StateRecord *> lines;
+  const StateRecord *r, *last = NULL;
+  const StateFile *head;
+  const char *map, *p, *end;
+  struct stat st;
+  int fd, ret = -1;
+
+  /* only a file of the user's own that no one else can write is trusted */
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+      st.st_mode & (S_IWGRP | S_IWOTH) ||
+      (size_t)st.st_size < sizeof(StateFile) ||
+      (map = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                                0)) == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  /* the records after the first torn one are lost with it */
+  head = (const StateFile *)map;
+  end = map + st.st_size;
+  if (!memcmp(head->magic, "mtstate\n", sizeof(head->magic)) &&
+      head->version == STATE_VERSION && head->layout == STATE_LAYOUT) {
+    for (p = map + sizeof(*head); (size_t)(end - p) >= sizeof(*r);
+         p += sizeof(*r) + STATE_ALIGN(r->len)) {
+      r = (const StateRecord *)p;
+      if (STATE_ALIGN(r->len) > (size_t)(end - p) - sizeof(*r) ||
+          r->sum != tstatesum((const char *)(r + 1), STATE_ALIGN(r->len)))
+        break;
+      if (r->tag == 'H')
+        lines.push_back(r);
+      else if (r->tag == 'S')
+        last = r;
+    }
+    if (last)
+      ret = tstateapply(last, lines);
+  }
+  munmap((void *)map, st.st_size);
+  return ret;
+}
+
+/*
+ * Puts the state of the S record s in place, with the history lines it
+ * names from the H records in lines, once it is known to be whole.
+ */
+int tstateapply(const StateRecord *s,
+                const std::vector<const StateRecord *> &lines) {
+  TCursor *c[] = {&term.c, &term.saved[0], &term.saved[1]};
+  const char *p = (const char *)(s + 1), *q, *start, *end;
+  std::vector<const HistLine *> hl;
+  const StateCursor *sc[3];
+  const HistLine *line;
+  const MTGlyph *g;
+  StateLines sl;
+  StateHead head;
+  size_t i, k, n, cells;
+  HistLine *copy;
+  int j, y;
+
+  if (s->len < sizeof(head))
+    return -1;
+  memcpy(&head, p, sizeof(head));
+  p += sizeof(head);
+  if (!BETWEEN(head.col, 1, USHRT_MAX) || !BETWEEN(head.row, 1, USHRT_MAX) ||
+      !BETWEEN(head.ncolors, 1, COLOR_MAX) || !BETWEEN(head.alt, 0, 1) ||
+      (head.mode & MODE_ALTSCREEN && !head.alt))
+    return -1;
+  cells = (size_t)head.row * head.col * (1 + head.alt);
+  if (s->len != sizeof(head) + head.col * sizeof(*term.tabs) +
+                    head.ncolors * sizeof(MTColor) + cells * sizeof(MTGlyph))
+    return -1;
+  sc[0] = &head.c;
+  sc[1] = &head.saved[0];
+  sc[2] = &head.saved[1];
+  for (j = 0; j < LEN(sc); j++) {
+    if (!BETWEEN(sc[j]->x, 0, head.col - 1) ||
+        !BETWEEN(sc[j]->y, 0, head.row - 1) ||
+        sc[j]->attr.color >= head.ncolors)
+      return -1;
+  }
+  if (!BETWEEN(head.top, 0, head.bot) || head.bot >= head.row ||
+      !BETWEEN(head.charset, 0, 3) || !BETWEEN(head.icharset, 0, 3))
+    return -1;
+  g = (const MTGlyph *)((const char *)(s + 1) + s->len) - cells;
+  for (i = 0; i < cells; i++) {
+    if (g[i].color >= head.ncolors)
+      return -1;
+  }
+
+  /* the history lines it names, those after the last one missing stay */
+  for (n = k = 0; n < lines.size(); n++)
+    k += lines[n]->len / sizeof(HistLine);
+  if (head.histn > k)
+    return -1;
+  hl.assign(head.histn, NULL);
+  for (n = 0; n < lines.size(); n++) {
+    q = (const char *)(lines[n] + 1);
+    end = q + lines[n]->len;
+    if (lines[n]->len < sizeof(sl))
+      continue;
+    memcpy(&sl, q, sizeof(sl));
+    q += sizeof(sl);
+
+    /* a record with a line that doesn't add up is left out whole */
+    start = q;
+    for (i = 0; i < sl.n && (size_t)(end - q) >= sizeof(HistLine); i++) {
+      line = (const HistLine *)q;
+      if (((line->size + 3) & ~(size_t)3) > (size_t)(end - q) ||
+          !thistcheck(line))
+        break;
+      q += (line->size + 3) & ~3;
+    }
+    if (i < sl.n)
+      continue;
+    for (q = start, i = 0; i < sl.n; i++) {
+      line = (const HistLine *)q;
+      if ((k = sl.first + i - head.histfirst) < head.histn)
+        hl[k] = line;
+      q += (line->size + 3) & ~3;
+    }
+  }
+  for (k = head.histn; k > 0 && hl[k - 1]; k--)
+    ;
+  k = MAX(k, head.histn - MIN(head.histn, (size_t)histlines));
+
+  selclear();
+  if (IS_SET(MODE_ALTSCREEN))
+    tswapscreen();
+  taltfree();
+  thistclear();
+  tresize(head.col, head.row);
+  if (head.alt) {
+    tscreenresize(&term.scr[1], 0, head.col, head.row);
+    term.alt = term.scr[1].ring;
+  }
+  memcpy(term.tabs, p, head.col * sizeof(*term.tabs));
+  p += head.col * sizeof(*term.tabs);
+
+  /* the pairs keep their index, the hash and the free list are made anew */
+  while (colortab.size < head.ncolors)
+    tcolorgrow();
+  memcpy(term.colors, p, head.ncolors * sizeof(MTColor));
+  term.ncolors = head.ncolors;
+  if (!colortab.free)
+    colortab.free = xmalloc<ushort>(COLOR_MAX);
+  memset(colortab.hash, 0, 2 * colortab.size * sizeof(uint32_t));
+  for (colortab.nfree = j = 0; j < term.ncolors; j++) {
+    if (term.colors[j].fg == COLOR_FREE)
+      colortab.free[colortab.nfree++] = j;
+    else
+      tcolorinsert(j);
+  }
+  colortab.dirty = 0;
+  colortab.sweepwait = 0;
+
+  for (j = 0; j <= head.alt; j++) {
+    for (y = 0; y < head.row; y++, g += head.col) {
+      memcpy((j ? term.alt : term.line)[y], g, head.col * sizeof(MTGlyph));
+      tlinescan((j ? term.alt : term.line)[y], head.col);
+    }
+  }
+  for (j = 0; j < LEN(c); j++)
+    *c[j] = {sc[j]->attr, sc[j]->x, sc[j]->y, (char)sc[j]->state};
+  term.top = head.top;
+  term.bot = head.bot;
+  term.mode = head.mode;
+  term.charset = head.charset;
+  term.icharset = head.icharset;
+  term.numlock = head.numlock;
+  memcpy(term.trantbl, head.trantbl, sizeof(term.trantbl));
+
+  for (; k < head.histn; k++) {
+    copy = reinterpret_cast<HistLine *>(xmalloc<char>(hl[k]->size));
+    memcpy(copy, hl[k], hl[k]->size);
+    thistappend(&hist, copy);
+  }
+  hist.pushed = head.histfirst + head.histn;
+  tfulldirt();
+  return 0;
+}
+
+/* catches torn and zeroed writes, not tampering; len is a multiple of 8 */
+uint64_t tstatesum(const char *s, size_t len) {
+  uint64_t h = len, w;
+
+  for (; len >= sizeof(w); s += sizeof(w), len -= sizeof(w)) {
+    memcpy(&w, s, sizeof(w));
+    h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
+/*
+ * The writer thread takes the records tstatesave queues and appends them
+ * to the file, or writes a new file next to it and renames it over the
+ * old one. After a failed write the next save starts the file over.
+ */
+void tstatewriter(void) {
+  std::string buf, path;
+  bool rewrite, failed = false;
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(statelock);
+      statebusy = false;
+      statecond->notify_all();
+      statecond->wait(lock, [] { return !stateq.empty(); });
+      buf.swap(stateq);
+      stateq.clear();
+      path = stateqpath;
+      rewrite = staterewrite;
+      staterewrite = false;
+      statebusy = true;
+    }
+    if (tstatewrite(path, &buf, rewrite) < 0) {
+      if (!failed)
+        fprintf(stderr, "mt: can't save the state to %s: %s\n", path.c_str(),
+                strerror(errno));
+      failed = true;
+      std::lock_guard<std::mutex> lock(statelock);
+      statelost = true;
+    } else {
+      failed = false;
+    }
+  }
+}
+
+int tstatewrite(const std::string &path, std::string *buf, bool rewrite) {
+  std::string tmp = path + ".new";
+  StateFile head = {};
+  StateRecord r;
+  size_t off;
+  int fd, err;
+
+  /* the checksums are left to this thread */
+  for (off = 0; off < buf->size(); off += sizeof(r) + STATE_ALIGN(r.len)) {
+    memcpy(&r, &(*buf)[off], sizeof(r));
+    r.sum = tstatesum(&(*buf)[off + sizeof(r)], STATE_ALIGN(r.len));
+    memcpy(&(*buf)[off], &r, sizeof(r));
+  }
+
+  /* whatever is in the way of the new file goes, links aren't followed */
+  if (rewrite) {
+    unlink(tmp.c_str());
+    fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+  } else {
+    fd = open(path.c_str(), O_WRONLY | O_APPEND | O_NOFOLLOW);
+  }
+  if (fd < 0)
+    return -1;
+  memcpy(head.magic, "mtstate\n", sizeof(head.magic));
+  head.version = STATE_VERSION;
+  head.layout = STATE_LAYOUT;
+  err = (rewrite && xwrite(fd, (const char *)&head, sizeof(head)) < 0) ||
+        xwrite(fd, buf->data(), buf->size()) < 0 || fdatasync(fd) < 0;
+  close(fd);
+  if (err || (rewrite && rename(tmp.c_str(), path.c_str()) < 0))
+    return -1;
+  return 0;
+}
+
+void tscrolldown(int orig, int n) {
+  LIMIT(n, 0, term.bot - orig + 1);
+
+  tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+  tscrolldirt(term.dirty, &term.scroll, term.col, orig, term.bot, -n);
+  tscreenrotate(orig, -n);
+
+  selscroll(orig, n);
+}
+
+/*
+ * Scrolls rows orig..term.bot up by n. With save, the rows leaving the top
+ * of the primary screen move into the history.
+ */
+void tscrollup(int orig, int n, int save) {
+  int i;
+
+  LIMIT(n, 0, term.bot - orig + 1);
+
+  if (save && orig == 0 && !IS_SET(MODE_ALTSCREEN)) {
+    for (i = 0; i < n; i++)
+      thistpush(term.line[i]);
+  }
+  tclearregion(0, orig, term.col - 1, orig + n - 1);
+  tscrolldirt(term.dirty, &term.scroll, term.col, orig, term.bot, n);
+  tscreenrotate(orig, n);
+
+  selscroll(orig, -n);
+}
+
+void selscroll(int orig, int n) {
+  if (sel.ob.x == -1)
+    return;
+
+  if (BETWEEN(sel.ob.y, orig, term.bot) || BETWEEN(sel.oe.y, orig, term.bot)) {
+    if ((sel.ob.y += n) > term.bot || (sel.oe.y += n) < term.top) {
+      selclear();
       return;
     }
     if (sel.type == SEL_RECTANGULAR) {
@@ -988,39 +2756,36 @@ void tnewline(int first_col) {
   int y = term.c.y;
 
   if (y == term.bot) {
-    tscrollup(term.top, 1);
+    tscrollup(term.top, 1, 1);
   } else {
     y++;
   }
   tmoveto(first_col ? 0 : term.c.x, y);
 }
 
-void csiparse(void) {
-  char *p = csiescseq.buf, *np;
-  long int v;
-
-  csiescseq.narg = 0;
-  if (*p == '?') {
-    csiescseq.priv = 1;
-    p++;
-  }
-
-  csiescseq.buf[csiescseq.len] = '\0';
-  while (p < csiescseq.buf + csiescseq.len) {
-    np = NULL;
-    v = strtol(p, &np, 10);
-    if (np == p)
-      v = 0;
-    if (v == LONG_MAX || v == LONG_MIN)
-      v = -1;
-    csiescseq.arg[csiescseq.narg++] = v;
-    p = np;
-    if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ)
-      break;
-    p++;
+/*
+ * Parameters are accumulated as their bytes arrive. Values saturate at
+ * ESC_ARG_MAX and parameters beyond ESC_ARG_SIZ are dropped.
+ */
+void csiparam(uchar c) {
+  int *v;
+
+  if (csiescseq.narg == 0)
+    csiescseq.narg = 1;
+  if (c == ';' || c == ':') {
+    if (csiescseq.narg == ESC_ARG_SIZ) {
+      csiescseq.narg++; /* drop everything from here on */
+    } else if (csiescseq.narg < ESC_ARG_SIZ) {
+      if (c == ':')
+        csiescseq.sub |= 1u << csiescseq.narg;
+      csiescseq.narg++;
+    }
+    return;
   }
-  csiescseq.mode[0] = *p++;
-  csiescseq.mode[1] = (p < csiescseq.buf + csiescseq.len) ? *p : '\0';
+  if (csiescseq.narg > ESC_ARG_SIZ)
+    return;
+  v = &csiescseq.arg[csiescseq.narg - 1];
+  *v = MIN(*v * 10 + (c - '0'), ESC_ARG_MAX);
 }
 
 /* for absolute user moves, when decom is set */
@@ -1044,6 +2809,8 @@ void tmoveto(int x, int y) {
 }
 
 void tsetchar(Rune u, MTGlyph *attr, int x, int y) {
+  MTGlyph *gp;
+  LineHeader *h;
   static const char *vt100_0[62] = {
       /* 0x41 - 0x7e */
       "↑", "↓", "→", "←", "█", "▚", "☃",      /* A - G */
@@ -1063,24 +2830,36 @@ void tsetchar(Rune u, MTGlyph *attr, int x, int y) {
       vt100_0[u - 0x41])
     utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
 
-  if (term.line[y][x].mode & ATTR_WIDE) {
+  /* writing a glyph over itself changes nothing, not even the damage */
+  gp = &term.line[y][x];
+  if (gp->u == u && !ATTRCMP(*gp, *attr))
+    return;
+
+  h = LINEHDR(term.line[y]);
+  h->len = MAX(h->len, x + 1);
+  h->attr |= attr->mode;
+  DIRTYADD(term.dirty[y], x, x);
+  if (gp->mode & ATTR_WIDE) {
     if (x + 1 < term.col) {
-      term.line[y][x + 1].u = ' ';
-      term.line[y][x + 1].mode &= ~ATTR_WDUMMY;
+      gp[1].u = ' ';
+      gp[1].mode &= ~ATTR_WDUMMY;
+      DIRTYADD(term.dirty[y], x, x + 1);
     }
-  } else if (term.line[y][x].mode & ATTR_WDUMMY) {
-    term.line[y][x - 1].u = ' ';
-    term.line[y][x - 1].mode &= ~ATTR_WIDE;
+  } else if (gp->mode & ATTR_WDUMMY) {
+    gp[-1].u = ' ';
+    gp[-1].mode &= ~ATTR_WIDE;
+    DIRTYADD(term.dirty[y], x - 1, x);
   }
 
-  term.dirty[y] = 1;
   term.line[y][x] = *attr;
   term.line[y][x].u = u;
 }
 
 void tclearregion(int x1, int y1, int x2, int y2) {
-  int x, y, temp;
-  MTGlyph *gp;
+  int y, temp, lo, hi;
+  MTGlyph blank = {' ', ATTR_NULL, term.c.attr.color};
+  Line line;
+  LineHeader *h;
 
   if (x1 > x2)
     temp = x1, x1 = x2, x2 = temp;
@@ -1092,17 +2871,34 @@ void tclearregion(int x1, int y1, int x2, int y2) {
   LIMIT(y1, 0, term.row - 1);
   LIMIT(y2, 0, term.row - 1);
 
+  if (selectedregion(x1, y1, x2, y2))
+    selclear();
+
+  /*
+   * Each row is filled with blanks from its first to its last cell that
+   * isn't one yet; the cells that already are stay clean.
+   */
   for (y = y1; y <= y2; y++) {
-    term.dirty[y] = 1;
-    for (x = x1; x <= x2; x++) {
-      gp = &term.line[y][x];
-      if (selected(x, y))
-        selclear();
-      gp->fg = term.c.attr.fg;
-      gp->bg = term.c.attr.bg;
-      gp->mode = 0;
-      gp->u = ' ';
+    line = term.line[y];
+    for (lo = x1; lo <= x2; lo++) {
+      if (line[lo].u != ' ' || ATTRCMP(line[lo], blank))
+        break;
+    }
+    for (hi = x2; hi > lo; hi--) {
+      if (line[hi].u != ' ' || ATTRCMP(line[hi], blank))
+        break;
     }
+    if (lo <= x2) {
+      std::fill(line + lo, line + hi + 1, blank);
+      DIRTYADD(term.dirty[y], lo, hi);
+    }
+
+    /* what was in use past the region stays so */
+    h = LINEHDR(line);
+    if (x2 + 1 >= h->len)
+      h->len = MIN(h->len, x1);
+    if (x1 == 0 && x2 == term.col - 1)
+      h->attr = 0;
   }
 }
 
@@ -1118,6 +2914,7 @@ void tdeletechar(int n) {
   line = term.line[term.c.y];
 
   memmove(&line[dst], &line[src], size * sizeof(MTGlyph));
+  DIRTYADD(term.dirty[term.c.y], dst, term.col - 1);
   tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
 }
 
@@ -1133,6 +2930,8 @@ void tinsertblank(int n) {
   line = term.line[term.c.y];
 
   memmove(&line[dst], &line[src], size * sizeof(MTGlyph));
+  LINEHDR(line)->len = MIN(LINEHDR(line)->len + n, term.col);
+  DIRTYADD(term.dirty[term.c.y], src, term.col - 1);
   tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1143,65 +2942,89 @@ void tinsertblankline(int n) {
 
 void tdeleteline(int n) {
   if (BETWEEN(term.c.y, term.top, term.bot))
-    tscrollup(term.c.y, n);
+    tscrollup(term.c.y, n, 0);
 }
 
-int32_t tdefcolor(int *attr, int *npar, int l) {
+/*
+ * Both the ';' form "38;2;r;g;b" and the ':' form "38:2:[id]:r:g:b" are
+ * accepted, the ':' form consumes all its sub-parameters.
+ */
+int32_t tdefcolor(int *attr, uint32_t sub, int *npar, int l) {
   int32_t idx = -1;
   uint r, g, b;
+  int i = *npar, n, used, colon;
+
+  /* sub-parameters following attr[i], or all the remaining parameters */
+  colon = i + 1 < l && sub & 1u << (i + 1);
+  for (n = 0; i + n + 1 < l && sub & 1u << (i + n + 1); n++)
+    ;
+  if (!colon)
+    n = l - i - 1;
+  /* the ':' form is consumed as a whole even when it is not understood */
+  used = colon ? n : 0;
 
-  switch (attr[*npar + 1]) {
+  switch (attr[i + 1]) {
   case 2: /* direct color in RGB space */
-    if (*npar + 4 >= l) {
+    if (n < 4) {
       fprintf(stderr, "erresc(38): Incorrect number of parameters (%d)\n",
               *npar);
       break;
     }
-    r = attr[*npar + 2];
-    g = attr[*npar + 3];
-    b = attr[*npar + 4];
-    *npar += 4;
+    if (colon && n >= 5)
+      i++; /* skip the color space id */
+    r = attr[i + 2];
+    g = attr[i + 3];
+    b = attr[i + 4];
     if (!BETWEEN(r, 0, 255) || !BETWEEN(g, 0, 255) || !BETWEEN(b, 0, 255))
       fprintf(stderr, "erresc: bad rgb color (%u,%u,%u)\n", r, g, b);
     else
       idx = TRUECOLOR(r, g, b);
+    if (!colon)
+      used = 4;
     break;
   case 5: /* indexed color */
-    if (*npar + 2 >= l) {
+    if (n < 2) {
       fprintf(stderr, "erresc(38): Incorrect number of parameters (%d)\n",
               *npar);
       break;
     }
-    *npar += 2;
-    if (!BETWEEN(attr[*npar], 0, 255))
-      fprintf(stderr, "erresc: bad fgcolor %d\n", attr[*npar]);
+    if (!BETWEEN(attr[i + 2], 0, 255))
+      fprintf(stderr, "erresc: bad fgcolor %d\n", attr[i + 2]);
     else
-      idx = attr[*npar];
+      idx = attr[i + 2];
+    if (!colon)
+      used = 2;
     break;
   case 0: /* implemented defined (only foreground) */
   case 1: /* transparent */
   case 3: /* direct color in CMY space */
   case 4: /* direct color in CMYK space */
   default:
-    fprintf(stderr, "erresc(38): gfx attr %d unknown\n", attr[*npar]);
+    fprintf(stderr, "erresc(38): gfx attr %d unknown\n", attr[i]);
     break;
   }
+  *npar += used;
 
   return idx;
 }
 
-void tsetattr(int *attr, int l) {
+void tsetattr(int *attr, uint32_t sub, int l) {
   int i;
   int32_t idx;
+  uint32_t fg = term.colors[term.c.attr.color].fg;
+  uint32_t bg = term.colors[term.c.attr.color].bg;
 
   for (i = 0; i < l; i++) {
+    /* a stray sub-parameter, what it belongs to was already handled */
+    if (sub & 1u << i)
+      continue;
     switch (attr[i]) {
     case 0:
       term.c.attr.mode &=
           ~(ATTR_BOLD | ATTR_FAINT | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_BLINK |
             ATTR_REVERSE | ATTR_INVISIBLE | ATTR_STRUCK);
-      term.c.attr.fg = defaultfg;
-      term.c.attr.bg = defaultbg;
+      fg = defaultfg;
+      bg = defaultbg;
       break;
     case 1:
       term.c.attr.mode |= ATTR_BOLD;
@@ -1212,8 +3035,11 @@ void tsetattr(int *attr, int l) {
     case 3:
       term.c.attr.mode |= ATTR_ITALIC;
       break;
-    case 4:
-      term.c.attr.mode |= ATTR_UNDERLINE;
+    case 4: /* "4:0" is no underline, "4:n" an underline style */
+      if (i + 1 < l && sub & 1u << (i + 1) && attr[i + 1] == 0)
+        term.c.attr.mode &= ~ATTR_UNDERLINE;
+      else
+        term.c.attr.mode |= ATTR_UNDERLINE;
       break;
     case 5: /* slow blink */
             /* FALLTHROUGH */
@@ -1251,28 +3077,28 @@ void tsetattr(int *attr, int l) {
       term.c.attr.mode &= ~ATTR_STRUCK;
       break;
     case 38:
-      if ((idx = tdefcolor(attr, &i, l)) >= 0)
-        term.c.attr.fg = idx;
+      if ((idx = tdefcolor(attr, sub, &i, l)) >= 0)
+        fg = idx;
       break;
     case 39:
-      term.c.attr.fg = defaultfg;
+      fg = defaultfg;
       break;
     case 48:
-      if ((idx = tdefcolor(attr, &i, l)) >= 0)
-        term.c.attr.bg = idx;
+      if ((idx = tdefcolor(attr, sub, &i, l)) >= 0)
+        bg = idx;
       break;
     case 49:
-      term.c.attr.bg = defaultbg;
+      bg = defaultbg;
       break;
     default:
       if (BETWEEN(attr[i], 30, 37)) {
-        term.c.attr.fg = attr[i] - 30;
+        fg = attr[i] - 30;
       } else if (BETWEEN(attr[i], 40, 47)) {
-        term.c.attr.bg = attr[i] - 40;
+        bg = attr[i] - 40;
       } else if (BETWEEN(attr[i], 90, 97)) {
-        term.c.attr.fg = attr[i] - 90 + 8;
+        fg = attr[i] - 90 + 8;
       } else if (BETWEEN(attr[i], 100, 107)) {
-        term.c.attr.bg = attr[i] - 100 + 8;
+        bg = attr[i] - 100 + 8;
       } else {
         fprintf(stderr, "erresc(default): gfx attr %d unknown\n", attr[i]),
             csidump();
@@ -1280,6 +3106,10 @@ void tsetattr(int *attr, int l) {
       break;
     }
   }
+
+  if (fg != term.colors[term.c.attr.color].fg ||
+      bg != term.colors[term.c.attr.color].bg)
+    term.c.attr.color = tcolor(fg, bg);
 }
 
 void tsetscroll(int t, int b) {
@@ -1385,6 +3215,11 @@ void tsetmode(int priv, int set, int *args, int narg) {
       case 2004: /* 2004: bracketed paste mode */
         MODBIT(term.mode, set, MODE_BRCKTPASTE);
         break;
+      case 2026: /* 2026: synchronized update, drawing waits for the end */
+        if (set && !IS_SET(MODE_SYNC))
+          clock_gettime(CLOCK_MONOTONIC, &term.synctime);
+        MODBIT(term.mode, set, MODE_SYNC);
+        break;
       /* Not implemented mouse modes. See comments there. */
       case 1001: /* mouse highlight mode; can hang the
                     terminal by design when implemented. */
@@ -1422,10 +3257,102 @@ void tsetmode(int priv, int set, int *args, int narg) {
   }
 }
 
+/*
+ * DECRQM answer for a mode: 0 not recognized, 1 set, 2 reset,
+ * 4 permanently reset.
+ */
+int tmodestate(int priv, int mode) {
+  int bit;
+
+  if (priv) {
+    switch (mode) {
+    case 1:
+      bit = MODE_APPCURSOR;
+      break;
+    case 5:
+      bit = MODE_REVERSE;
+      break;
+    case 6:
+      return (term.c.state & CURSOR_ORIGIN) ? 1 : 2;
+    case 7:
+      bit = MODE_WRAP;
+      break;
+    case 25:
+      return IS_SET(MODE_HIDE) ? 2 : 1;
+    case 9:
+      bit = MODE_MOUSEX10;
+      break;
+    case 1000:
+      bit = MODE_MOUSEBTN;
+      break;
+    case 1002:
+      bit = MODE_MOUSEMOTION;
+      break;
+    case 1003:
+      bit = MODE_MOUSEMANY;
+      break;
+    case 1004:
+      bit = MODE_FOCUS;
+      break;
+    case 1006:
+      bit = MODE_MOUSESGR;
+      break;
+    case 1034:
+      bit = MODE_8BIT;
+      break;
+    case 47:
+    case 1047:
+    case 1049:
+      if (!allowaltscreen)
+        return 4;
+      bit = MODE_ALTSCREEN;
+      break;
+    case 2004:
+      bit = MODE_BRCKTPASTE;
+      break;
+    case 2026:
+      bit = MODE_SYNC;
+      break;
+    case 2:
+    case 3:
+    case 4:
+    case 8:
+    case 12:
+    case 18:
+    case 19:
+    case 42:
+      return 4; /* ignored by tsetmode() */
+    default:
+      return 0;
+    }
+  } else {
+    switch (mode) {
+    case 2:
+      bit = MODE_KBDLOCK;
+      break;
+    case 4:
+      bit = MODE_INSERT;
+      break;
+    case 12:
+      return IS_SET(MODE_ECHO) ? 2 : 1;
+    case 20:
+      bit = MODE_CRLF;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return IS_SET(bit) ? 1 : 2;
+}
+
 void csihandle(void) {
   char buf[40];
   int len;
 
+  /* only the DEC private marker is understood */
+  if (csiescseq.priv && csiescseq.priv != '?')
+    goto unknown;
+
   switch (csiescseq.mode[0]) {
   default:
   unknown:
@@ -1530,6 +3457,9 @@ void csihandle(void) {
     case 2: /* all */
       tclearregion(0, 0, term.col - 1, term.row - 1);
       break;
+    case 3: /* scrollback */
+      thistclear();
+      break;
     default:
       goto unknown;
     }
@@ -1549,7 +3479,7 @@ void csihandle(void) {
     break;
   case 'S': /* SU -- Scroll <n> line up */
     DEFAULT(csiescseq.arg[0], 1);
-    tscrollup(term.top, csiescseq.arg[0]);
+    tscrollup(term.top, csiescseq.arg[0], 0);
     break;
   case 'T': /* SD -- Scroll <n> line down */
     DEFAULT(csiescseq.arg[0], 1);
@@ -1586,7 +3516,7 @@ void csihandle(void) {
     tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
     break;
   case 'm': /* SGR -- Terminal attribute (color) */
-    tsetattr(csiescseq.arg, csiescseq.narg);
+    tsetattr(csiescseq.arg, csiescseq.sub, csiescseq.narg);
     break;
   case 'n': /* DSR – Device Status Report (cursor position) */
     if (csiescseq.arg[0] == 6) {
@@ -1611,6 +3541,18 @@ void csihandle(void) {
   case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
     tcursor(CURSOR_LOAD);
     break;
+  case '$':
+    switch (csiescseq.mode[1]) {
+    case 'p': /* DECRQM -- Request mode */
+      len = snprintf(buf, sizeof(buf), "\033[%s%d;%d$y",
+                     csiescseq.priv ? "?" : "", csiescseq.arg[0],
+                     tmodestate(csiescseq.priv, csiescseq.arg[0]));
+      ttywrite(buf, len);
+      break;
+    default:
+      goto unknown;
+    }
+    break;
   case ' ':
     switch (csiescseq.mode[1]) {
     case 'q': /* DECSCUSR -- Set Cursor Style */
@@ -1631,20 +3573,20 @@ void csidump(void) {
   int i;
   uint c;
 
-  fprintf(stderr, "ESC[");
-  for (i = 0; i < csiescseq.len; i++) {
-    c = csiescseq.buf[i] & 0xff;
-    if (isprint(c)) {
-      putc(c, stderr);
-    } else if (c == '\n') {
-      fprintf(stderr, "(\\n)");
-    } else if (c == '\r') {
-      fprintf(stderr, "(\\r)");
-    } else if (c == 0x1b) {
-      fprintf(stderr, "(\\e)");
-    } else {
+  fprintf(stderr, "ESC[");
+  if (csiescseq.priv)
+    putc(csiescseq.priv, stderr);
+  for (i = 0; i < csiescseq.narg; i++) {
+    if (i)
+      putc(csiescseq.sub & 1u << i ? ':' : ';', stderr);
+    fprintf(stderr, "%d", csiescseq.arg[i]);
+  }
+  for (i = 0; i < csiescseq.nmode; i++) {
+    c = csiescseq.mode[i] & 0xff;
+    if (isprint(c))
+      putc(c, stderr);
+    else
       fprintf(stderr, "(%02x)", c);
-    }
   }
   putc('\n', stderr);
 }
@@ -1655,7 +3597,8 @@ void strhandle(void) {
   char *p = NULL;
   int j, narg, par;
 
-  term.esc &= ~(ESC_STR_END | ESC_STR);
+  if (strescseq.total > strmaxbytes)
+    return;
   strparse();
   par = (narg = strescseq.narg) ? atoi(strescseq.args[0]) : 0;
 
@@ -1669,17 +3612,8 @@ void strhandle(void) {
         xsettitle(strescseq.args[1]);
       return;
     case 52:
-      if (narg > 2) {
-        char *dec;
-
-        dec = base64dec(strescseq.args[2]);
-        if (dec) {
-          xsetsel(dec, CurrentTime);
-          clipcopy(NULL);
-        } else {
-          fprintf(stderr, "erresc: invalid base64\n");
-        }
-      }
+      if (strescseq.b64 != B64_OFF)
+        osc52end();
       return;
     case 4: /* color set */
       if (narg < 3)
@@ -1704,7 +3638,6 @@ void strhandle(void) {
     xsettitle(strescseq.args[0]);
     return;
   case 'P': /* DCS -- Device Control String */
-    term.esc |= ESC_DCS;
   case '_': /* APC -- Application Program Command */
   case '^': /* PM -- Privacy Message */
     return;
@@ -1719,10 +3652,9 @@ void strparse(void) {
   char *p = strescseq.buf;
 
   strescseq.narg = 0;
-  strescseq.buf[strescseq.len] = '\0';
-
-  if (*p == '\0')
+  if (strescseq.len == 0)
     return;
+  strescseq.buf[strescseq.len] = '\0';
 
   while (strescseq.narg < STR_ARG_SIZ) {
     strescseq.args[strescseq.narg++] = p;
@@ -1759,7 +3691,98 @@ void strdump(void) {
   fprintf(stderr, "ESC\\\n");
 }
 
-void strreset(void) { memset(&strescseq, 0, sizeof(strescseq)); }
+void strreset(void) {
+  char *buf = strescseq.buf;
+  size_t size = strescseq.size;
+
+  /* keep a small buffer around, give back what a big string took */
+  if (size > STR_BUF_SIZ) {
+    free(buf);
+    buf = NULL;
+    size = 0;
+  }
+  free(strescseq.dec);
+  memset(&strescseq, 0, sizeof(strescseq));
+  strescseq.buf = buf;
+  strescseq.size = size;
+}
+
+/*
+ * Append to the string being received. Strings longer than strmaxbytes
+ * are dropped as a whole. The payload of OSC 52 is not buffered but
+ * decoded as it arrives once "52;<targets>;" is complete.
+ */
+void strwrite(const char *s, size_t n) {
+  char *p;
+
+  if ((strescseq.total += n) > strmaxbytes) {
+    if (strescseq.total - n <= strmaxbytes)
+      fprintf(stderr, "erresc: string longer than %u bytes dropped\n",
+              strmaxbytes);
+    strescseq.len = 0;
+    strescseq.b64 = B64_OFF;
+    return;
+  }
+  if (strescseq.b64 != B64_OFF) {
+    osc52put(s, n);
+    return;
+  }
+
+  if (strescseq.len + n >= strescseq.size) {
+    strescseq.size = MAX(strescseq.size * 2, STR_BUF_SIZ);
+    strescseq.size = MAX(strescseq.size, strescseq.len + n + 1);
+    strescseq.buf = xrealloc<char>(strescseq.buf, strescseq.size);
+  }
+  memcpy(strescseq.buf + strescseq.len, s, n);
+  strescseq.len += n;
+
+  if (strescseq.type == ']' && strescseq.len > 3 &&
+      !memcmp(strescseq.buf, "52;", 3) &&
+      (p = (char *)memchr(strescseq.buf + 3, ';', strescseq.len - 3))) {
+    n = strescseq.buf + strescseq.len - (p + 1);
+    strescseq.len = p - strescseq.buf;
+    strescseq.b64 = B64_DATA;
+    osc52put(p + 1, n);
+  }
+}
+
+void osc52put(const char *s, size_t n) {
+  const char *end = s + n;
+  int v;
+
+  if (strescseq.b64 != B64_DATA)
+    return;
+  /* less than a byte per digit, plus the terminator */
+  if (strescseq.declen + n + 1 > strescseq.decsize) {
+    strescseq.decsize = MAX(strescseq.decsize * 2, strescseq.declen + n + 1);
+    strescseq.dec = xrealloc<char>(strescseq.dec, strescseq.decsize);
+  }
+  for (; s < end; s++) {
+    if ((v = base64_digits.v[(uchar)*s]) < 0) {
+      strescseq.b64 = v == -2 ? B64_END : B64_ERROR;
+      return;
+    }
+    strescseq.acc = strescseq.acc << 6 | v;
+    if ((strescseq.accbits += 6) >= 8) {
+      strescseq.accbits -= 8;
+      strescseq.dec[strescseq.declen++] = strescseq.acc >> strescseq.accbits;
+    }
+  }
+}
+
+void osc52end(void) {
+  if (strescseq.b64 == B64_ERROR) {
+    fprintf(stderr, "erresc: invalid base64\n");
+    return;
+  }
+  if (!strescseq.dec)
+    strescseq.dec = xmalloc<char>(1);
+  strescseq.dec[strescseq.declen] = '\0';
+  /* the selection takes the buffer over */
+  xsetsel(strescseq.dec, CurrentTime);
+  strescseq.dec = NULL;
+  clipcopy(NULL);
+}
 
 void sendbreak(const Arg *arg) {
   if (tcsendbreak(cmdfd, 0))
@@ -1890,28 +3913,6 @@ void tdectest(char c) {
   }
 }
 
-void tstrsequence(uchar c) {
-  strreset();
-
-  switch (c) {
-  case 0x90: /* DCS -- Device Control String */
-    c = 'P';
-    term.esc |= ESC_DCS;
-    break;
-  case 0x9f: /* APC -- Application Program Command */
-    c = '_';
-    break;
-  case 0x9e: /* PM -- Privacy Message */
-    c = '^';
-    break;
-  case 0x9d: /* OSC -- Operating System Command */
-    c = ']';
-    break;
-  }
-  strescseq.type = c;
-  term.esc |= ESC_STR;
-}
-
 void tcontrolcode(uchar ascii) {
   switch (ascii) {
   case '\t': /* HT */
@@ -1930,20 +3931,10 @@ void tcontrolcode(uchar ascii) {
     tnewline(IS_SET(MODE_CRLF));
     return;
   case '\a': /* BEL */
-    if (term.esc & ESC_STR_END) {
-      /* backwards compatibility to xterm */
-      strhandle();
-    } else {
-      if (!(win.state & WIN_FOCUSED))
-        xseturgency(1);
-      if (bell)
-        xbell();
-    }
-    break;
-  case '\033': /* ESC */
-    csireset();
-    term.esc &= ~(ESC_CSI | ESC_ALTCHARSET | ESC_TEST);
-    term.esc |= ESC_START;
+    if (!(win.state & WIN_FOCUSED))
+      xseturgency(1);
+    if (bell)
+      xbell();
     return;
   case '\016': /* SO (LS1 -- Locking shift 1) */
   case '\017': /* SI (LS0 -- Locking shift 0) */
@@ -1953,28 +3944,27 @@ void tcontrolcode(uchar ascii) {
     tsetchar('?', &term.c.attr, term.c.x, term.c.y);
   case '\030': /* CAN */
     csireset();
-    break;
+    return;
   case '\005': /* ENQ (IGNORED) */
   case '\000': /* NUL (IGNORED) */
   case '\021': /* XON (IGNORED) */
   case '\023': /* XOFF (IGNORED) */
-  case 0177:   /* DEL (IGNORED) */
     return;
   case 0x80: /* TODO: PAD */
   case 0x81: /* TODO: HOP */
   case 0x82: /* TODO: BPH */
   case 0x83: /* TODO: NBH */
   case 0x84: /* TODO: IND */
-    break;
+    return;
   case 0x85:     /* NEL -- Next line */
     tnewline(1); /* always go to first col */
-    break;
+    return;
   case 0x86: /* TODO: SSA */
   case 0x87: /* TODO: ESA */
-    break;
+    return;
   case 0x88: /* HTS -- Horizontal tab stop */
     term.tabs[term.c.x] = 1;
-    break;
+    return;
   case 0x89: /* TODO: HTJ */
   case 0x8a: /* TODO: VTS */
   case 0x8b: /* TODO: PLD */
@@ -1989,62 +3979,46 @@ void tcontrolcode(uchar ascii) {
   case 0x95: /* TODO: MW */
   case 0x96: /* TODO: SPA */
   case 0x97: /* TODO: EPA */
-  case 0x98: /* TODO: SOS */
   case 0x99: /* TODO: SGCI */
-    break;
+    return;
   case 0x9a: /* DECID -- Identify Terminal */
     ttywrite(vt102_identify, strlen(vt102_identify));
-    break;
-  case 0x9b: /* TODO: CSI */
-  case 0x9c: /* TODO: ST */
-    break;
-  case 0x90: /* DCS -- Device Control String */
-  case 0x9d: /* OSC -- Operating System Command */
-  case 0x9e: /* PM -- Privacy Message */
-  case 0x9f: /* APC -- Application Program Command */
-    tstrsequence(ascii);
     return;
   }
-  /* only CAN, SUB, \a and C1 chars interrupt a sequence */
-  term.esc &= ~(ESC_STR_END | ESC_STR);
 }
 
-/*
- * returns 1 when the sequence is finished and it hasn't to read
- * more characters for this sequence, otherwise 0
- */
-int eschandle(uchar ascii) {
-  switch (ascii) {
-  case '[':
-    term.esc |= ESC_CSI;
-    return 0;
+void eschandle(uchar ascii) {
+  /* at most one intermediate byte is meaningful here */
+  switch (csiescseq.nmode ? csiescseq.mode[0] : 0) {
   case '#':
-    term.esc |= ESC_TEST;
-    return 0;
+    tdectest(ascii);
+    return;
   case '%':
-    term.esc |= ESC_UTF8;
-    return 0;
-  case 'P': /* DCS -- Device Control String */
-  case '_': /* APC -- Application Program Command */
-  case '^': /* PM -- Privacy Message */
-  case ']': /* OSC -- Operating System Command */
-  case 'k': /* old title set compatibility */
-    tstrsequence(ascii);
-    return 0;
-  case 'n': /* LS2 -- Locking shift 2 */
-  case 'o': /* LS3 -- Locking shift 3 */
-    term.charset = 2 + (ascii - 'n');
-    break;
+    tdefutf8(ascii);
+    return;
   case '(': /* GZD4 -- set primary charset G0 */
   case ')': /* G1D4 -- set secondary charset G1 */
   case '*': /* G2D4 -- set tertiary charset G2 */
   case '+': /* G3D4 -- set quaternary charset G3 */
-    term.icharset = ascii - '(';
-    term.esc |= ESC_ALTCHARSET;
-    return 0;
+    term.icharset = csiescseq.mode[0] - '(';
+    tdeftran(ascii);
+    return;
+  case 0:
+    break;
+  default:
+    fprintf(stderr, "erresc: unknown sequence ESC '%c' '%c'\n",
+            csiescseq.mode[0], isprint(ascii) ? ascii : '.');
+    return;
+  }
+
+  switch (ascii) {
+  case 'n': /* LS2 -- Locking shift 2 */
+  case 'o': /* LS3 -- Locking shift 3 */
+    term.charset = 2 + (ascii - 'n');
+    break;
   case 'D': /* IND -- Linefeed */
     if (term.c.y == term.bot) {
-      tscrollup(term.top, 1);
+      tscrollup(term.top, 1, 1);
     } else {
       tmoveto(term.c.x, term.c.y + 1);
     }
@@ -2082,138 +4056,303 @@ int eschandle(uchar ascii) {
   case '8': /* DECRC -- Restore Cursor */
     tcursor(CURSOR_LOAD);
     break;
-  case '\\': /* ST -- String Terminator */
-    if (term.esc & ESC_STR_END)
-      strhandle();
+  case '\\': /* ST -- String Terminator, the string was already handled */
     break;
   default:
     fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n", (uchar)ascii,
             isprint(ascii) ? ascii : '.');
     break;
   }
-  return 1;
 }
 
-void tputc(Rune u) {
+/*
+ * Transitions of the DEC ANSI parser. Apart from the usual diagram, BEL
+ * terminates any string for compatibility with xterm, ESC k starts the
+ * old title string, CAN and SUB drop a pending OSC and ':' is kept as a
+ * parameter byte of CSI sequences.
+ */
+constexpr uint8_t vtentry(int action, int state) {
+  return action << 4 | state;
+}
+
+constexpr uint8_t vttransition(int s, int c) {
+  /* "anywhere" transitions */
+  if (c == 030 || c == 032)
+    return vtentry(VT_EXECUTE, VT_GROUND);
+  if (c == 033)
+    return vtentry(s == VT_OSC_STRING ? VT_OSC_END : VT_NONE, VT_ESCAPE);
+  if (c == 0x90)
+    return vtentry(VT_NONE, VT_DCS_ENTRY);
+  if (c == 0x9b)
+    return vtentry(VT_NONE, VT_CSI_ENTRY);
+  if (c == 0x9c) /* ST */
+    return vtentry(s == VT_OSC_STRING ? VT_OSC_END : VT_NONE, VT_GROUND);
+  if (c == 0x9d)
+    return vtentry(VT_NONE, VT_OSC_STRING);
+  if (c == 0x98 || c == 0x9e || c == 0x9f)
+    return vtentry(VT_NONE, VT_SOS_PM_APC_STRING);
+  if (ISCONTROLC1(c))
+    return vtentry(VT_EXECUTE, VT_GROUND);
+
+  switch (s) {
+  case VT_GROUND:
+    if (ISCONTROLC0(c))
+      return vtentry(c == 0177 ? VT_NONE : VT_EXECUTE, VT_STAY);
+    return vtentry(VT_PRINT, VT_STAY);
+  case VT_ESCAPE:
+  case VT_ESCAPE_INTERMEDIATE:
+    if (ISCONTROLC0(c))
+      return vtentry(c == 0177 ? VT_NONE : VT_EXECUTE, VT_STAY);
+    if (BETWEEN(c, 0x20, 0x2f))
+      return vtentry(VT_COLLECT, VT_ESCAPE_INTERMEDIATE);
+    if (s == VT_ESCAPE_INTERMEDIATE)
+      return vtentry(VT_ESC_DISPATCH, VT_GROUND);
+    switch (c) {
+    case '[':
+      return vtentry(VT_NONE, VT_CSI_ENTRY);
+    case ']':
+    case 'k':
+      return vtentry(VT_NONE, VT_OSC_STRING);
+    case 'P':
+      return vtentry(VT_NONE, VT_DCS_ENTRY);
+    case 'X':
+    case '^':
+    case '_':
+      return vtentry(VT_NONE, VT_SOS_PM_APC_STRING);
+    }
+    return vtentry(VT_ESC_DISPATCH, VT_GROUND);
+  case VT_CSI_ENTRY:
+  case VT_CSI_PARAM:
+  case VT_CSI_INTERMEDIATE:
+  case VT_CSI_IGNORE:
+    if (ISCONTROLC0(c))
+      return vtentry(c == 0177 ? VT_NONE : VT_EXECUTE, VT_STAY);
+    if (BETWEEN(c, 0x40, 0x7e))
+      return s == VT_CSI_IGNORE ? vtentry(VT_NONE, VT_GROUND)
+                                : vtentry(VT_CSI_DISPATCH, VT_GROUND);
+    if (s == VT_CSI_IGNORE)
+      return vtentry(VT_NONE, VT_STAY);
+    if (BETWEEN(c, 0x20, 0x2f))
+      return vtentry(VT_COLLECT, VT_CSI_INTERMEDIATE);
+    if (s == VT_CSI_INTERMEDIATE)
+      return vtentry(VT_NONE, VT_CSI_IGNORE);
+    if (BETWEEN(c, 0x30, 0x3b))
+      return vtentry(VT_PARAM, VT_CSI_PARAM);
+    if (BETWEEN(c, 0x3c, 0x3f) && s == VT_CSI_ENTRY)
+      return vtentry(VT_COLLECT, VT_CSI_PARAM);
+    return vtentry(VT_NONE, VT_CSI_IGNORE);
+  case VT_DCS_ENTRY:
+  case VT_DCS_PARAM:
+  case VT_DCS_INTERMEDIATE:
+    if (c == '\a')
+      return vtentry(VT_NONE, VT_GROUND);
+    if (ISCONTROLC0(c))
+      return vtentry(VT_NONE, VT_STAY);
+    if (BETWEEN(c, 0x40, 0x7e))
+      return vtentry(VT_NONE, VT_DCS_PASSTHROUGH);
+    if (BETWEEN(c, 0x20, 0x2f))
+      return vtentry(VT_COLLECT, VT_DCS_INTERMEDIATE);
+    if (s == VT_DCS_INTERMEDIATE)
+      return vtentry(VT_NONE, VT_DCS_IGNORE);
+    if (BETWEEN(c, 0x30, 0x39) || c == ';')
+      return vtentry(VT_PARAM, VT_DCS_PARAM);
+    if (BETWEEN(c, 0x3c, 0x3f) && s == VT_DCS_ENTRY)
+      return vtentry(VT_COLLECT, VT_DCS_PARAM);
+    return vtentry(VT_NONE, VT_DCS_IGNORE);
+  case VT_DCS_PASSTHROUGH:
+    if (c == '\a')
+      return vtentry(VT_NONE, VT_GROUND);
+    return vtentry(c == 0177 ? VT_NONE : VT_PUT, VT_STAY);
+  case VT_OSC_STRING:
+    if (c == '\a')
+      return vtentry(VT_OSC_END, VT_GROUND);
+    if (BETWEEN(c, 0, 0x1f))
+      return vtentry(VT_NONE, VT_STAY);
+    return vtentry(VT_OSC_PUT, VT_STAY);
+  case VT_DCS_IGNORE:
+  case VT_SOS_PM_APC_STRING:
+    if (c == '\a')
+      return vtentry(VT_NONE, VT_GROUND);
+    return vtentry(VT_NONE, VT_STAY);
+  }
+  return vtentry(VT_NONE, VT_STAY);
+}
+
+constexpr VtTable vtbuild(void) {
+  VtTable v{};
+
+  for (int s = 0; s < VT_NSTATES; s++) {
+    for (int c = 0; c < VT_NCLASSES; c++)
+      v.t[s][c] = vttransition(s, c);
+  }
+  return v;
+}
+
+static constexpr VtTable vttable = vtbuild();
+
+/* keep a private marker or intermediate byte of a sequence header */
+void tcollect(uchar c) {
+  if (BETWEEN(term.esc, VT_DCS_ENTRY, VT_DCS_IGNORE)) {
+    strwrite((char *)&c, 1);
+  } else if (BETWEEN(c, 0x3c, 0x3f)) {
+    csiescseq.priv = c;
+  } else if (csiescseq.nmode < LEN(csiescseq.mode)) {
+    csiescseq.mode[csiescseq.nmode++] = c;
+  }
+}
+
+void tstrput(Rune u) {
   char c[UTF_SIZ];
-  int control;
-  int width, len;
-  MTGlyph *gp;
+  size_t len;
 
-  control = ISCONTROL(u);
   if (!IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
     c[0] = u;
-    width = len = 1;
+    len = 1;
   } else {
     len = utf8encode(u, c);
-    if (!control && (width = wcwidth(u)) == -1) {
-      memcpy(c, "\357\277\275", 4); /* UTF_INVALID */
-      width = 1;
-    }
   }
+  strwrite(c, len);
+}
 
-  if (IS_SET(MODE_PRINT))
-    tprinter(c, len);
+/* entry action of the state the parser moves to */
+void tvtenter(int state, Rune u) {
+  switch (state) {
+  case VT_ESCAPE:
+  case VT_CSI_ENTRY:
+    csireset();
+    break;
+  case VT_DCS_ENTRY:
+  case VT_OSC_STRING:
+  case VT_SOS_PM_APC_STRING:
+    /* the 7 bit form of the introducer gives the string type */
+    strreset();
+    strescseq.type = ISCONTROLC1(u) ? u - 0x40 : u;
+    break;
+  case VT_DCS_PASSTHROUGH: /* hook */
+    if (u == 'q' && strescseq.len == 0)
+      term.mode |= MODE_SIXEL;
+    tstrput(u);
+    break;
+  }
+}
 
-  /*
-   * STR sequence must be checked before anything else
-   * because it uses all following characters until it
-   * receives a ESC, a SUB, a ST or any other C1 control
-   * character.
-   */
-  if (term.esc & ESC_STR) {
-    if (u == '\a' || u == 030 || u == 032 || u == 033 || ISCONTROLC1(u)) {
-      term.esc &= ~(ESC_START | ESC_STR | ESC_DCS);
-      if (IS_SET(MODE_SIXEL)) {
-        /* TODO: render sixel */;
-        term.mode &= ~MODE_SIXEL;
-        return;
-      }
-      term.esc |= ESC_STR_END;
-      goto check_control_code;
-    }
+/* exit action of the state the parser leaves */
+void tvtleave(int state) {
+  if (state != VT_DCS_PASSTHROUGH) /* unhook */
+    return;
+  if (IS_SET(MODE_SIXEL)) {
+    /* TODO: render sixel */;
+    term.mode &= ~MODE_SIXEL;
+    return;
+  }
+  strhandle();
+}
 
-    if (IS_SET(MODE_SIXEL)) {
-      /* TODO: implement sixel mode */
-      return;
-    }
-    if (term.esc & ESC_DCS && strescseq.len == 0 && u == 'q')
-      term.mode |= MODE_SIXEL;
+void tputc(Rune u) {
+  uint8_t t;
+  int next;
 
-    if (strescseq.len + len >= sizeof(strescseq.buf) - 1) {
-      /*
-       * Here is a bug in terminals. If the user never sends
-       * some code to stop the str or esc command, then st
-       * will stop responding. But this is better than
-       * silently failing with unknown characters. At least
-       * then users will report back.
-       *
-       * In the case users ever get fixed, here is the code:
-       */
-      /*
-       * term.esc = 0;
-       * strhandle();
-       */
-      return;
-    }
+  if (IS_SET(MODE_PRINT)) {
+    char c[UTF_SIZ];
 
-    memmove(&strescseq.buf[strescseq.len], c, len);
-    strescseq.len += len;
-    return;
+    if (!IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
+      c[0] = u;
+      tprinter(c, 1);
+    } else {
+      tprinter(c, utf8encode(u, c));
+    }
   }
 
-check_control_code:
+  t = vttable.t[term.esc][MIN(u, VT_NCLASSES - 1)];
+  next = t & 0xf;
+  if (next != VT_STAY)
+    tvtleave(term.esc);
+
   /*
-   * Actions of control codes must be performed as soon they arrive
-   * because they can be embedded inside a control sequence, and
-   * they must not cause conflicts with sequences.
+   * Actions of control codes are performed as soon they arrive
+   * because they can be embedded inside a control sequence.
    */
-  if (control) {
+  switch (t >> 4) {
+  case VT_PRINT:
+    tputchar(u);
+    break;
+  case VT_EXECUTE:
     tcontrolcode(u);
-    /*
-     * control codes are not shown ever
-     */
-    return;
-  } else if (term.esc & ESC_START) {
-    if (term.esc & ESC_CSI) {
-      csiescseq.buf[csiescseq.len++] = u;
-      if (BETWEEN(u, 0x40, 0x7E) ||
-          csiescseq.len >= sizeof(csiescseq.buf) - 1) {
-        term.esc = 0;
-        csiparse();
-        csihandle();
-      }
-      return;
-    } else if (term.esc & ESC_UTF8) {
-      tdefutf8(u);
-    } else if (term.esc & ESC_ALTCHARSET) {
-      tdeftran(u);
-    } else if (term.esc & ESC_TEST) {
-      tdectest(u);
-    } else {
-      if (!eschandle(u))
-        return;
-      /* sequence already finished */
-    }
-    term.esc = 0;
-    /*
-     * All characters which form part of a sequence are not
-     * printed
-     */
-    return;
+    break;
+  case VT_COLLECT:
+    tcollect(u);
+    break;
+  case VT_PARAM:
+    if (BETWEEN(term.esc, VT_DCS_ENTRY, VT_DCS_IGNORE))
+      tcollect(u);
+    else
+      csiparam(u);
+    break;
+  case VT_ESC_DISPATCH:
+    eschandle(u);
+    break;
+  case VT_CSI_DISPATCH:
+    csiescseq.mode[MIN(csiescseq.nmode, 1)] = u;
+    csiescseq.nmode = MIN(csiescseq.nmode + 1, 2);
+    LIMIT(csiescseq.narg, 1, ESC_ARG_SIZ);
+    csihandle();
+    break;
+  case VT_PUT:
+    if (!IS_SET(MODE_SIXEL)) /* TODO: implement sixel mode */
+      tstrput(u);
+    break;
+  case VT_OSC_PUT:
+    tstrput(u);
+    break;
+  case VT_OSC_END:
+    strhandle();
+    break;
   }
+
+  if (next != VT_STAY) {
+    term.esc = next;
+    tvtenter(next, u);
+  }
+}
+
+/* the generated table doesn't depend on the locale, unlike wcwidth() */
+int runewidth(Rune u) {
+  switch (runewidthclass(u)) {
+  case WIDTH_ZERO:
+    return 0;
+  case WIDTH_WIDE:
+    return 2;
+  case WIDTH_AMBIGUOUS:
+    return ambiguouswidth;
+  }
+  return 1;
+}
+
+void tputchar(Rune u) {
+  int width;
+  MTGlyph *gp;
+  LineHeader *h;
+
+  width = IS_SET(MODE_UTF8) ? runewidth(u) : 1;
+
   if (sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y))
     selclear();
 
   gp = &term.line[term.c.y][term.c.x];
   if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
     gp->mode |= ATTR_WRAP;
+    LINEHDR(term.line[term.c.y])->attr |= ATTR_WRAP;
+    DIRTYADD(term.dirty[term.c.y], term.c.x, term.c.x);
     tnewline(1);
     gp = &term.line[term.c.y][term.c.x];
   }
 
-  if (IS_SET(MODE_INSERT) && term.c.x + width < term.col)
+  if (IS_SET(MODE_INSERT) && term.c.x + width < term.col) {
     memmove(gp + width, gp, (term.col - term.c.x - width) * sizeof(MTGlyph));
+    h = LINEHDR(term.line[term.c.y]);
+    h->len = MIN(h->len + width, term.col);
+    DIRTYADD(term.dirty[term.c.y], term.c.x, term.col - 1);
+  }
 
   if (term.c.x + width > term.col) {
     tnewline(1);
@@ -2223,10 +4362,15 @@ check_control_code:
   tsetchar(u, &term.c.attr, term.c.x, term.c.y);
 
   if (width == 2) {
+    h = LINEHDR(term.line[term.c.y]);
     gp->mode |= ATTR_WIDE;
+    h->attr |= ATTR_WIDE;
     if (term.c.x + 1 < term.col) {
       gp[1].u = '\0';
       gp[1].mode = ATTR_WDUMMY;
+      h->len = MAX(h->len, term.c.x + 2);
+      h->attr |= ATTR_WDUMMY;
+      DIRTYADD(term.dirty[term.c.y], term.c.x, term.c.x + 1);
     }
   }
   if (term.c.x + width < term.col) {
@@ -2236,12 +4380,138 @@ check_control_code:
   }
 }
 
+/*
+ * Returns the length of the run of printable ASCII at the start of s.
+ */
+size_t asciirun(const char *s, size_t n) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i lo = _mm_set1_epi8(0x1f);
+  const __m128i hi = _mm_set1_epi8(0x7f);
+
+  /* bytes >= 0x80 are negative as signed chars and fail the first test */
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+    int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)));
+    if (mask != 0xffff)
+      return i + __builtin_ctz(~mask);
+  }
+#endif
+  while (i < n && ISPRINTASCII((uchar)s[i]))
+    ++i;
+
+  return i;
+}
+
+/*
+ * Writes a run of printable ASCII at the cursor, as tputc() would do one
+ * character at a time. The terminal must be in the ground state. Wrapping,
+ * insertion and dirtiness are handled once per line segment.
+ */
+void tputascii(const char *s, size_t n) {
+  MTGlyph *line, *gp;
+  MTGlyph g;
+  LineHeader *h;
+  int x, len, i, lo, hi;
+
+  /* the special graphics charset needs translation of each character */
+  if (term.trantbl[term.charset] == CS_GRAPHIC0) {
+    while (n--)
+      tputc(*s++);
+    return;
+  }
+
+  if (IS_SET(MODE_PRINT))
+    tprinter(s, n);
+
+  g = term.c.attr;
+  while (n > 0) {
+    if (term.c.state & CURSOR_WRAPNEXT) {
+      if (IS_SET(MODE_WRAP)) {
+        term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
+        LINEHDR(term.line[term.c.y])->attr |= ATTR_WRAP;
+        DIRTYADD(term.dirty[term.c.y], term.c.x, term.c.x);
+        tnewline(1);
+      } else {
+        /* everything lands on the last column, only the last one stays */
+        s += n - 1;
+        n = 1;
+      }
+    }
+
+    if (sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y))
+      selclear();
+
+    x = term.c.x;
+    len = MIN(n, (size_t)(term.col - x));
+    line = term.line[term.c.y];
+    gp = &line[x];
+    h = LINEHDR(line);
+
+    /* don't leave halves of wide characters at the edges of the segment */
+    if (gp->mode & ATTR_WDUMMY) {
+      line[x - 1].u = ' ';
+      line[x - 1].mode &= ~ATTR_WIDE;
+      DIRTYADD(term.dirty[term.c.y], x - 1, x - 1);
+    }
+    if (IS_SET(MODE_INSERT) && x + len < term.col) {
+      memmove(gp + len, gp, (term.col - x - len) * sizeof(MTGlyph));
+      h->len = MIN(h->len + len, term.col);
+      if (gp[len].mode & ATTR_WDUMMY) {
+        gp[len].u = ' ';
+        gp[len].mode &= ~ATTR_WDUMMY;
+      }
+      DIRTYADD(term.dirty[term.c.y], x + len, term.col - 1);
+    } else if (x + len < term.col && (gp[len - 1].mode & ATTR_WIDE)) {
+      gp[len].u = ' ';
+      gp[len].mode &= ~ATTR_WDUMMY;
+      DIRTYADD(term.dirty[term.c.y], x + len, x + len);
+    }
+
+    /* only what differs from the glyphs already there is damage */
+    for (lo = 0; lo < len; lo++) {
+      if (gp[lo].u != (uchar)s[lo] || ATTRCMP(gp[lo], g))
+        break;
+    }
+    for (hi = len; hi > lo; hi--) {
+      if (gp[hi - 1].u != (uchar)s[hi - 1] || ATTRCMP(gp[hi - 1], g))
+        break;
+    }
+    for (i = lo; i < hi; i++) {
+      g.u = (uchar)s[i];
+      gp[i] = g;
+    }
+    if (lo < hi) {
+      h->len = MAX(h->len, x + hi);
+      h->attr |= g.mode;
+      DIRTYADD(term.dirty[term.c.y], x + lo, x + hi - 1);
+    }
+
+    s += len;
+    n -= len;
+    if (x + len < term.col) {
+      tmoveto(x + len, term.c.y);
+    } else {
+      term.c.x = term.col - 1;
+      term.c.state |= CURSOR_WRAPNEXT;
+    }
+  }
+}
+
 void tresize(int col, int row) {
-  int i;
+  int i, x, y;
   int minrow = MIN(row, term.row);
   int mincol = MIN(col, term.col);
+  int slide = MAX(term.c.y - row + 1, 0);
+  int alt = IS_SET(MODE_ALTSCREEN), reflow = term.col && col != term.col;
+  size_t h, top, keep, bytes, limit = (size_t)histmegabytes << 20;
+  TCursor *pc = alt ? &term.saved[0] : &term.c;
+  History rows = {};
+  Line *line;
   int *bp;
-  TCursor c;
+  TCursor c, rc = *pc;
 
   if (col < 1 || row < 1) {
     fprintf(stderr, "tresize: error resizing to %dx%d\n", col, row);
@@ -2249,44 +4519,30 @@ void tresize(int col, int row) {
   }
 
   /*
-   * slide screen to keep cursor where we expect it -
-   * tscrollup would work here, but we can optimize to
-   * memmove because we're freeing the earlier lines
+   * slide screen to keep cursor where we expect it; the rows above it
+   * that no longer fit go to the history from the primary screen. A new
+   * width rewraps the primary screen with the history instead, its rows
+   * are put back once the screens have their new size.
    */
-  for (i = 0; i <= term.c.y - row; i++) {
-    free(term.line[i]);
-    free(term.alt[i]);
-  }
-  /* ensure that both src and dst are not NULL */
-  if (i > 0) {
-    memmove(term.line, term.line + i, row * sizeof(Line));
-    memmove(term.alt, term.alt + i, row * sizeof(Line));
+  if (reflow) {
+    selclear();
+    treflow(&rows, col, &rc, &h);
+  } else {
+    for (i = 0; i < slide; i++)
+      thistpush((alt ? term.alt : term.line)[i]);
   }
-  for (i += row; i < term.row; i++) {
-    free(term.line[i]);
-    free(term.alt[i]);
+  for (i = 0; i < 2; i++) {
+    if (i == 0 || term.alt)
+      tscreenresize(&term.scr[i], reflow && i == alt ? 0 : slide, col, row);
   }
+  term.line = term.scr[0].ring;
+  term.alt = term.scr[1].ring;
 
-  /* resize to new width */
-  term.specbuf = xrealloc<XftGlyphFontSpec>(term.specbuf, col);
-
-  /* resize to new height */
-  term.line = xrealloc<Line>(term.line, row * sizeof(Line));
-  term.alt = xrealloc<Line>(term.alt, row * sizeof(Line));
-  term.dirty = xrealloc<int>(term.dirty, row);
+  term.dirty = xrealloc<LineDirty>(term.dirty, row);
+  for (i = 0; i < row; i++)
+    DIRTYCLEAR(term.dirty[i]);
+  term.scroll.n = 0;
   term.tabs = xrealloc<int>(term.tabs, col);
-
-  /* resize each row to new width, zero-pad if needed */
-  for (i = 0; i < minrow; i++) {
-    term.line[i] = xrealloc<MTGlyph>(term.line[i], col);
-    term.alt[i] = xrealloc<MTGlyph>(term.alt[i], col);
-  }
-
-  /* allocate any new rows */
-  for (/* i = minrow */; i < row; i++) {
-    term.line[i] = xmalloc<MTGlyph>(col);
-    term.alt[i] = xmalloc<MTGlyph>(col);
-  }
   // If the window was widened, tabstops may need to be added.
   if (col > term.col) {
     // Guess the width based on the first tabstop (user may have adjusted it).
@@ -2322,10 +4578,77 @@ void tresize(int col, int row) {
     if (0 < col && minrow < row) {
       tclearregion(0, minrow, col - 1, row - 1);
     }
+    if (!term.alt)
+      break;
     tswapscreen();
     tcursor(CURSOR_LOAD);
   }
   term.c = c;
+
+  if (reflow) {
+    /*
+     * The cursor keeps its row on the screen, the rows above are history.
+     * When the rows below it no longer fit, the cursor moves up so that
+     * the ones above make room, rather than losing text off the bottom.
+     */
+    line = alt ? term.alt : term.line;
+    top = h - MIN(h, (size_t)MIN(pc->y, row - 1));
+    if (rows.n > top + row)
+      top = MIN(h, rows.n - row);
+    for (y = 0; y < row; y++) {
+      if (top + y < rows.n) {
+        thistline(HISTLINE(rows, top + y), line[y]);
+      } else {
+        for (x = 0; x < col; x++)
+          line[y][x] = {' ', ATTR_NULL, 0};
+      }
+      tlinescan(line[y], col);
+    }
+    pc->x = rc.x;
+    pc->y = h - top;
+    pc->state = rc.state;
+
+    for (keep = bytes = 0; keep < MIN(top, (size_t)histlines); keep++) {
+      bytes += HISTLINE(rows, top - keep - 1)->size;
+      if (limit && bytes > limit)
+        break;
+    }
+    for (h = 0; h < rows.n; h++) {
+      if (h < top && h + keep >= top)
+        thistappend(&hist, HISTLINE(rows, h));
+      else
+        free(HISTLINE(rows, h));
+    }
+    free(rows.line);
+    hist.epoch++;
+    term.view = 0;
+    tfulldirt();
+  }
+}
+
+/* moves the view arg->i lines back into the history, -1 is a page */
+void kscrollup(const Arg *arg) {
+  size_t n = arg->i < 0 ? MAX(term.row + arg->i, 1) : arg->i;
+
+  if (IS_SET(MODE_ALTSCREEN))
+    return;
+  n = MIN(term.view + n, hist.n) - term.view;
+  if (n > 0) {
+    /* the selection is in screen rows, the history can't be selected */
+    selclear();
+    term.view += n;
+    tfulldirt();
+  }
+}
+
+void kscrolldown(const Arg *arg) {
+  int n = arg->i < 0 ? MAX(term.row + arg->i, 1) : arg->i;
+
+  n = MIN(n, term.view);
+  if (n > 0) {
+    term.view -= n;
+    tfulldirt();
+  }
 }
 
 void zoom(const Arg *arg) {
@@ -2350,7 +4673,12 @@ void resettitle(void) { xsettitle(opt_title ? opt_title : "mt"); }
 
 void redraw(void) {
   tfulldirt();
-  draw();
+  /* the X thread picks dirty lines up with its next frame */
+  if (ttythreaded) {
+    tnotify();
+  } else {
+    draw();
+  }
 }
 
 int match(uint mask, uint state) {
@@ -1,6 +1,7 @@
 #ifndef MT_MT_H
 #define MT_MT_H
 
+#include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <ctime>
@@ -18,12 +19,15 @@ extern "C" {
 #define LEN(a) (sizeof(a) / sizeof(a)[0])
 #define BETWEEN(x, a, b) ((a) <= (x) && (x) <= (b))
 #define LIMIT(x, a, b) (x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b)                                                          \
-  ((a).mode != (b).mode || (a).fg != (b).fg || (a).bg != (b).bg)
+#define ATTRCMP(a, b) ((a).mode != (b).mode || (a).color != (b).color)
 #define IS_SET(flag) ((term.mode & (flag)) != 0)
 #define TIMEDIFF(t1, t2)                                                       \
   ((t1.tv_sec - t2.tv_sec) * 1000 + (t1.tv_nsec - t2.tv_nsec) / 1E6)
 #define MODBIT(x, set, bit) ((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
+#define DIRTY(d) ((d).x1 <= (d).x2)
+#define DIRTYADD(d, a, b) ((d).x1 = MIN((d).x1, (a)), (d).x2 = MAX((d).x2, (b)))
+#define DIRTYCLEAR(d) ((d).x1 = INT_MAX, (d).x2 = -1)
+#define LINEHDR(l) ((LineHeader *)((l) - 1))
 
 #define TRUECOLOR(r, g, b) (1 << 24 | (r) << 16 | (g) << 8 | (b))
 #define IS_TRUECOL(x) (1 << 24 & (x))
@@ -68,6 +72,7 @@ enum term_mode {
   MODE_PRINT       = 1 << 20,
   MODE_UTF8        = 1 << 21,
   MODE_SIXEL       = 1 << 22,
+  MODE_SYNC        = 1 << 23,
   MODE_MOUSE       = MODE_MOUSEBTN | MODE_MOUSEMOTION | MODE_MOUSEX10 |
                      MODE_MOUSEMANY,
 };
@@ -88,14 +93,58 @@ typedef unsigned short ushort;
 typedef uint_least32_t Rune;
 
 typedef struct {
-  Rune u;      /* character code */
-  ushort mode; /* attribute flags */
+  Rune u;       /* character code */
+  ushort mode;  /* attribute flags */
+  ushort color; /* index of the colors in term.colors */
+} MTGlyph;
+static_assert(sizeof(MTGlyph) == 8, "glyphs are copied in bulk");
+
+/* a foreground and background pair, shared by all glyphs that use it */
+typedef struct {
   uint32_t fg; /* foreground  */
   uint32_t bg; /* background  */
-} MTGlyph;
+} MTColor;
 
 typedef MTGlyph *Line;
 
+/*
+ * What is known about a line of a screen without looking at its glyphs,
+ * kept up to date as they are written. It takes the place of a glyph in
+ * front of the line, LINEHDR(line).
+ */
+typedef struct {
+  ushort len;  /* the glyphs from len on are spaces */
+  ushort attr; /* every attribute of its glyphs, ATTR_WRAP too, maybe more */
+} LineHeader;
+static_assert(sizeof(LineHeader) <= sizeof(MTGlyph), "a header takes a glyph");
+
+/*
+ * A screen is a single slab of row * (col + 1) glyphs, each row preceded
+ * by its header. Its rows are reached through a ring of 2 * row pointers
+ * whose second half mirrors the first, so that ring + head can be indexed
+ * 0..row-1 from any head. The slab is mapped on its own, so that
+ * freeing a screen gives its pages back to the system.
+ */
+typedef struct {
+  MTGlyph *cells; /* row * (col + 1) glyphs */
+  Line *ring;     /* row pointers, mirrored */
+  int head;       /* ring index of the top row */
+  size_t size;    /* bytes mapped for cells */
+} TScreen;
+
+/* columns of a line changed since it was drawn, none while x1 > x2 */
+typedef struct {
+  int x1;
+  int x2;
+} LineDirty;
+
+/* rows top..bot moved up by n, or down when negative, since they were drawn */
+typedef struct {
+  int top;
+  int bot;
+  int n;
+} LineScroll;
+
 typedef struct {
   MTGlyph attr; /* current char attributes */
   int x;
@@ -109,18 +158,25 @@ typedef struct {
   int col;                /* nb col */
   Line *line;             /* screen */
   Line *alt;              /* alternate screen */
-  int *dirty;             /* dirtyness of lines */
-  XftGlyphFontSpec *specbuf; /* font spec buffer used for rendering */
+  TScreen scr[2];         /* storage of line and alt */
+  LineDirty *dirty;       /* changed columns of lines */
+  LineScroll scroll;      /* scroll of the drawn lines, pending */
   TCursor c;              /* cursor */
+  TCursor saved[2];       /* cursors saved on either screen */
+  int view;               /* lines scrolled back into the history */
+  MTColor *colors;        /* color pairs the glyphs refer to */
+  int ncolors;            /* entries of colors in use */
   int top;                /* top    scroll limit */
   int bot;                /* bottom scroll limit */
   int mode;               /* terminal mode flags */
-  int esc;                /* escape state flags */
+  int esc;                /* parser state */
   char trantbl[4];        /* charset table translation */
   int charset;            /* current charset */
   int icharset;           /* selected charset for sequence */
   int numlock;            /* lock numbers in keyboard */
   int *tabs;
+  struct timespec synctime; /* start of a synchronized update */
+  struct timespec altleft;  /* when the alternate screen was left */
 } Term;
 
 /* Purely graphic info */
@@ -133,10 +189,25 @@ typedef struct {
   int cursor; /* cursor style */
 } TermWindow;
 
+union Arg {
+  Arg(int val) { i = val; }
+  Arg(uint val) { i = val; }
+  Arg(float val) { f = val; }
+  Arg(const void *val) { v = val; }
+
+  int i;
+  uint ui;
+  float f;
+  const void *v;
+};
+
 typedef struct {
   uint b;
   uint mask;
-  const char *s;
+  const char *s;             /* sent to the tty, unless func is set */
+  void (*func)(const Arg *); /* called with arg */
+  const Arg arg;
+  int screen; /* 1 only on the alternate screen, -1 only on the primary */
 } MouseShortcut;
 
 typedef struct {
@@ -162,17 +233,16 @@ typedef struct {
   // Atom xtarget;
 } Selection;
 
-union Arg {
-  Arg(int val) { i = val; }
-  Arg(uint val) { i = val; }
-  Arg(float val) { f = val; }
-  Arg(const void *val) { v = val; }
-
-  int i;
-  uint ui;
-  float f;
-  const void *v;
-};
+/* Throughput counters, reported after each flood */
+typedef struct {
+  uint64_t bytes;       /* read from the pty and parsed */
+  uint64_t frames;      /* drawn */
+  double parsems;       /* time spent reading and parsing */
+  double drawms;        /* time spent drawing */
+  uint64_t requests;    /* sent to the X server while drawing */
+  uint64_t glyphhits;   /* glyph lookups answered by the cache */
+  uint64_t glyphmisses; /* and those that went to the font */
+} TtyStats;
 
 typedef struct {
   uint mod;
@@ -188,12 +258,25 @@ int tattrset(int);
 void tnew(int, int);
 void tsetdirt(int, int);
 void tsetdirtattr(int);
+void tsnapshot(Term *, Selection *);
+int tsyncing(void);
+long taltidle(const struct timespec *);
+void tstateopen(const char *);
+long tstatesave(const struct timespec *);
+void tstatesync(void);
+int tstateload(const char *);
+void tlock(void);
+void tunlock(void);
 int match(uint, uint);
 void ttynew(void);
 size_t ttyread(void);
+int ttystart(void);
+void ttyack(void);
 void ttyresize(void);
 void ttysend(const char *, size_t);
 void ttywrite(const char *, size_t);
+void ttyflushq(void);
+int ttyqueued(void);
 
 void resettitle(void);
 
@@ -204,6 +287,7 @@ void selclear(void);
 void selinit(void);
 void selnormalize(void);
 int selected(int, int);
+int selcontains(const Selection *, int, int);
 char *getsel(void);
 int x2col(int);
 int y2row(int);
@@ -217,6 +301,7 @@ char *xstrdup(char *);
 extern TermWindow win;
 extern Term term;
 extern Selection sel;
+extern TtyStats ttystats;
 extern int cmdfd;
 extern pid_t pid;
 extern char **opt_cmd;
@@ -225,6 +310,7 @@ extern char *opt_embed;
 extern char *opt_font;
 extern char *opt_io;
 extern char *opt_name;
+extern char *opt_session;
 extern char *opt_title;
 extern int oldbutton;
 
@@ -236,8 +322,14 @@ extern float chscale;
 extern unsigned int doubleclicktimeout;
 extern unsigned int tripleclicktimeout;
 extern int allowaltscreen;
+extern int threaded;
 extern unsigned int xfps;
 extern unsigned int actionfps;
+extern unsigned int floodbytes;
+extern unsigned int floodfps;
+extern int floodstats;
+extern int renderrows;
+extern int rasterize;
 extern unsigned int cursorthickness;
 extern unsigned int blinktimeout;
 extern char termname[];
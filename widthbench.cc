@@ -0,0 +1,110 @@
+/*
+ * widthbench -- compare the generated width table with libc wcwidth().
+ *
+ * usage: widthbench [runes]
+ *
+ * Both lookups run over a CJK-heavy and an emoji-heavy stream of
+ * pseudo-random runes. One line per stream and lookup is printed as
+ * "stream lookup runes ns/rune" followed by the runes they disagree on.
+ */
+#include "width.h"
+
+#include <clocale>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cwchar>
+#include <vector>
+
+#define LEN(a) (sizeof(a) / sizeof(a)[0])
+
+typedef struct {
+  uint32_t lo, hi;
+  int weight;
+} Range;
+
+/* Han, kana, hangul and fullwidth forms with some ASCII and punctuation */
+static const Range cjk[] = {
+    {0x4e00, 0x9fff, 50}, {0x3040, 0x30ff, 15}, {0xac00, 0xd7a3, 15},
+    {0xff01, 0xff5e, 5},  {0x3000, 0x303f, 5},  {0x0020, 0x007e, 10},
+};
+
+/* pictographs, ZWJ sequences, variation selectors and skin tones */
+static const Range emoji[] = {
+    {0x1f300, 0x1f5ff, 35}, {0x1f600, 0x1f64f, 20}, {0x1f900, 0x1f9ff, 15},
+    {0x2600, 0x27bf, 10},   {0x200d, 0x200d, 5},    {0xfe0f, 0xfe0f, 5},
+    {0x1f3fb, 0x1f3ff, 5},  {0x0020, 0x007e, 5},
+};
+
+static std::vector<uint32_t> stream(const Range *, int, size_t);
+static double now(void);
+static int tablewidth(uint32_t);
+static void bench(const char *, const std::vector<uint32_t> &);
+
+std::vector<uint32_t> stream(const Range *r, int n, size_t len) {
+  std::vector<uint32_t> s;
+  int i, total = 0, pick;
+
+  for (i = 0; i < n; i++)
+    total += r[i].weight;
+  srand(1);
+  while (s.size() < len) {
+    pick = rand() % total;
+    for (i = 0; pick >= r[i].weight; i++)
+      pick -= r[i].weight;
+    s.push_back(r[i].lo + rand() % (r[i].hi - r[i].lo + 1));
+  }
+  return s;
+}
+
+double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1E9 + ts.tv_nsec;
+}
+
+/* what the terminal does with the table, ambiguous as narrow */
+int tablewidth(uint32_t u) {
+  static const int width[] = {0, 1, 2, 1};
+
+  return width[runewidthclass(u)];
+}
+
+void bench(const char *name, const std::vector<uint32_t> &s) {
+  double t0, t1, t2;
+  long sum1 = 0, sum2 = 0, diff = 0;
+  size_t i;
+  int w;
+
+  t0 = now();
+  for (i = 0; i < s.size(); i++)
+    sum1 += tablewidth(s[i]);
+  t1 = now();
+  for (i = 0; i < s.size(); i++) {
+    /* mt draws what wcwidth() rejects as a narrow replacement */
+    w = wcwidth(s[i]);
+    sum2 += w < 0 ? 1 : w;
+  }
+  t2 = now();
+
+  for (i = 0; i < s.size(); i++) {
+    w = wcwidth(s[i]);
+    diff += (w < 0 ? 1 : w) != tablewidth(s[i]);
+  }
+  printf("%s table %zu %.2f\n", name, s.size(), (t1 - t0) / s.size());
+  printf("%s wcwidth %zu %.2f\n", name, s.size(), (t2 - t1) / s.size());
+  printf("%s mismatch %ld columns %ld %ld\n", name, diff, sum1, sum2);
+}
+
+int main(int argc, char *argv[]) {
+  size_t len = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+
+  if (!setlocale(LC_CTYPE, "C.UTF-8") && !setlocale(LC_CTYPE, "en_US.UTF-8"))
+    fprintf(stderr, "widthbench: no UTF-8 locale, wcwidth() is ASCII only\n");
+
+  bench("cjk", stream(cjk, LEN(cjk), len));
+  bench("emoji", stream(emoji, LEN(emoji), len));
+  return 0;
+}
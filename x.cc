@@ -1,6 +1,10 @@
 #include "x.h"
 
 #include <algorithm>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include <cerrno>
 #include <clocale>
@@ -16,12 +20,22 @@ extern "C" {
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
+#include <X11/extensions/XShm.h>
 #include <X11/keysym.h>
 #include <libgen.h>
+#include <sys/ipc.h>
 #include <sys/select.h>
+#include <sys/shm.h>
 #include <unistd.h>
 }
 
+#include <ft2build.h>
+#include FT_SYNTHESIS_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "font.h"
 #include "mt.h"
 
@@ -29,11 +43,24 @@ extern "C" {
 #define XEMBED_FOCUS_IN 4
 #define XEMBED_FOCUS_OUT 5
 
+/* flood mode: window for the output rate and idle time ending a flood, ms */
+#define FLOOD_WINDOW 100
+#define FLOOD_IDLE 20
+
 /* macros */
 #define TRUERED(x) (((x)&0xff0000) >> 8)
 #define TRUEGREEN(x) (((x)&0xff00))
 #define TRUEBLUE(x) (((x)&0xff) << 8)
 
+/* variants of the palette, dc.col holds COLOR_VARIANTS of them after another */
+#define COLOR_REVERSE 1 /* for MODE_REVERSE */
+#define COLOR_FAINT 2   /* for ATTR_FAINT */
+#define COLOR_VARIANTS 4
+#define XCOLOR(i, var) (dc.col[(var) * dc.collen + (i)])
+#define COLOR_CACHE 1024 /* truecolors kept allocated */
+#define RASTER_GLYPHS 4096 /* glyph masks kept by the rasterizer */
+#define GLYPH_BITS 12       /* of the slots of the glyph lookup cache */
+
 typedef XftDraw *Draw;
 typedef XftColor Color;
 
@@ -59,19 +86,74 @@ typedef struct { Atom xtarget; } XSelection;
 
 /* Drawing Context */
 typedef struct {
-  Color *col;
-  size_t collen;
+  Color *col;    /* the palette and its variants, see XCOLOR */
+  size_t collen; /* entries of the palette */
   std::unique_ptr<MTFont> font;
   GC gc;
 } DC;
 
+/* What a frame draws in one color, see xbatchrow */
+typedef struct {
+  Color color;
+  std::vector<XRectangle> fills; /* backgrounds and borders */
+  std::vector<XRectangle> lines; /* underlines and strikethroughs */
+  std::vector<XftGlyphFontSpec> specs;
+  std::vector<XftGlyphFontSpec> xft; /* left to Xft by the rasterizer */
+  /* the row of the frame and the end of its specs, or of its xft */
+  std::vector<std::pair<int, size_t>> rows, xftrows;
+} DrawBatch;
+
+/* A cached glyph lookup, see xfindglyph */
+typedef struct {
+  uint32_t key; /* rune and style, ~0 when empty */
+  MTFont::Glyph glyph;
+} GlyphSlot;
+
+/* A glyph of the rasterizer, see xrasterglyph */
+typedef struct {
+  int left, top; /* of the mask, from the origin of the glyph */
+  int w, h;
+  int xft; /* drawn by Xft, a color glyph or one FreeType failed on */
+  std::vector<uint8_t> mask;
+} GlyphMask;
+
+/* Client-side image the rasterizer draws rows into, see xrasterrow */
+typedef struct {
+  XImage *img;
+  XShmSegmentInfo shm;
+  int useshm;        /* the image is in a segment shared with the server */
+  int busy;          /* the server may still be reading the segment */
+  std::vector<XRectangle> damage; /* drawn and not uploaded yet */
+  std::unordered_map<uint64_t, GlyphMask> glyphs; /* by font and index */
+  std::vector<XftFont *> fonts; /* the fonts in the keys of glyphs */
+} Raster;
+
 static inline ushort sixd_to_16bit(int);
+static MTFont::Glyph xfindglyph(Rune, int);
+static void xclearglyphs(void);
 static int xmakeglyphfontspecs(XftGlyphFontSpec *, const MTGlyph *, int, int,
                                int);
-static void xdrawglyphfontspecs(const XftGlyphFontSpec *, MTGlyph, int, int,
-                                int);
-static void xdrawglyph(MTGlyph, int, int);
+static void xdrawglyphfontspecs(const XftGlyphFontSpec *, MTGlyph, MTColor, int,
+                                int, int);
+static void xdrawglyph(MTGlyph, MTColor, int, int);
 static void xclear(int, int, int, int);
+static void xloadvariants(int, int);
+static XRenderColor xcolorvariant(XRenderColor, int, int);
+static Color *xglyphcolor(uint32_t, int);
+static void xglyphcolors(MTGlyph, MTColor, Color **, Color **);
+static void xbatchrow(int, int, int, int);
+static void xbatchfill(std::vector<XRectangle> *, XRectangle);
+static void xjoinfills(std::vector<XRectangle> *);
+static void xdrawframe(void);
+static void xrasterframe(void);
+static int xrasterinit(void);
+static void xrasterresize(void);
+static void xrasterflush(void);
+static const GlyphMask *xrasterglyph(XftFont *, FT_UInt);
+static void xrasterfill(uint32_t, const XRectangle *);
+static void xrasterblend(uint32_t *, const uint8_t *, int, uint32_t);
+static DrawBatch *xbatch(const Color *);
+static Color *xcachecolor(const XRenderColor *);
 static void xdrawcursor(void);
 static int xgeommasktogravity(int);
 
@@ -93,6 +175,7 @@ static void selrequest(XEvent *);
 static void selcopy(Time);
 static void getbuttoninfo(XEvent *);
 static void mousereport(XEvent *);
+static int xflood(int, struct timespec *);
 
 void handle(XEvent *ev) {
   switch (ev->type) {
@@ -136,6 +219,39 @@ void handle(XEvent *ev) {
 static DC dc;
 static XWindow xw;
 static XSelection xsel;
+static XftGlyphFontSpec *specbuf; /* font spec buffer used for rendering */
+
+/* The batches of the frame being drawn and the clip of each of its rows */
+static struct {
+  std::vector<DrawBatch> batch;
+  int n;
+  std::unordered_map<uint64_t, int> index; /* of the batches by RGBA */
+  std::vector<XRectangle> rows;
+} frame;
+static Raster rs;
+
+/*
+ * Glyph lookup cache in front of the font: flat for Latin-1, direct-mapped
+ * by a hash for the rest. Glyphs no font has are cached like any other.
+ */
+static GlyphSlot glyphlatin[4 << 8], glyphslots[1 << GLYPH_BITS];
+
+/*
+ * Screen being drawn: term itself, or a snapshot of it that the reader
+ * thread doesn't touch in threaded mode. Without threads the snapshot is
+ * used while the view is in the history.
+ */
+static Term snapterm;
+static Selection snapsel;
+static Term *dterm = &term;
+static Selection *dsel = &sel;
+static int oldx, oldy; /* where the cursor was drawn */
+static std::mutex drawlock; /* guards dc.col against the reader thread */
+
+/* truecolors drawn lately, the latest first, and where they are in it */
+typedef std::list<std::pair<uint64_t, Color>> ColorList;
+static ColorList colorlru;
+static std::unordered_map<uint64_t, ColorList::iterator> colorcache;
 
 void getbuttoninfo(XEvent *e) {
   int type;
@@ -225,12 +341,21 @@ void bpress(XEvent *e) {
   }
 
   for (ms = mshortcuts; ms < mshortcuts + mshortcutslen; ms++) {
+    if (ms->screen && (ms->screen > 0) != IS_SET(MODE_ALTSCREEN))
+      continue;
     if (e->xbutton.button == ms->b && match(ms->mask, e->xbutton.state)) {
-      ttysend(ms->s, strlen(ms->s));
+      if (ms->func)
+        ms->func(&ms->arg);
+      else
+        ttysend(ms->s, strlen(ms->s));
       return;
     }
   }
 
+  /* the selection is in screen rows, the history can't be selected */
+  if (e->xbutton.button == Button1 && term.view)
+    return;
+
   if (e->xbutton.button == Button1) {
     clock_gettime(CLOCK_MONOTONIC, &now);
 
@@ -490,11 +615,21 @@ void xresize(int col, int row) {
   win.tw = MAX(1, col * win.cw);
   win.th = MAX(1, row * win.ch);
 
+  specbuf = static_cast<XftGlyphFontSpec *>(
+      realloc(specbuf, col * sizeof(XftGlyphFontSpec)));
+  if (!specbuf)
+    die("Out of memory\n");
+
   XFreePixmap(xw.dpy, xw.buf);
   xw.buf =
       XCreatePixmap(xw.dpy, xw.win, win.w, win.h, DefaultDepth(xw.dpy, xw.scr));
   XftDrawChange(xw.draw, xw.buf);
   xclear(0, 0, win.w, win.h);
+
+  if (rasterize) {
+    xrasterresize();
+    rasterize = rs.img != NULL;
+  }
 }
 
 ushort sixd_to_16bit(int x) { return x == 0 ? 0 : 0x3737 + 0x2828 * x; }
@@ -523,17 +658,18 @@ int xloadcolor(int i, const char *name, Color *ncolor) {
 
 void xloadcols(void) {
   int i;
-  static int loaded;
   Color *cp;
+  std::lock_guard<std::mutex> lock(drawlock);
 
-  dc.collen = MAX(colornamelen, 256);
-  dc.col = static_cast<Color *>(malloc(dc.collen * sizeof(Color)));
-  if (!dc.col)
-    die("Out of memory\n");
-
-  if (loaded) {
-    for (cp = dc.col; cp < &dc.col[dc.collen]; ++cp)
+  if (dc.col) {
+    for (cp = dc.col; cp < &dc.col[COLOR_VARIANTS * dc.collen]; ++cp)
       XftColorFree(xw.dpy, xw.vis, xw.cmap, cp);
+  } else {
+    dc.collen = MAX(colornamelen, 256);
+    dc.col = static_cast<Color *>(
+        malloc(COLOR_VARIANTS * dc.collen * sizeof(Color)));
+    if (!dc.col)
+      die("Out of memory\n");
   }
 
   for (i = 0; i < dc.collen; i++)
@@ -543,13 +679,15 @@ void xloadcols(void) {
       else
         die("Could not allocate color %d\n", i);
     }
-  loaded = 1;
+  for (i = 0; i < dc.collen; i++)
+    xloadvariants(i, 0);
 }
 
 int xsetcolorname(int x, const char *name) {
   Color ncolor;
+  std::lock_guard<std::mutex> lock(drawlock);
 
-  if (!BETWEEN(x, 0, dc.collen))
+  if (!BETWEEN(x, 0, dc.collen - 1))
     return 1;
 
   if (!xloadcolor(x, name, &ncolor))
@@ -557,15 +695,110 @@ int xsetcolorname(int x, const char *name) {
 
   XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
   dc.col[x] = ncolor;
+  xloadvariants(x, 1);
+  /* the reverse of either default color is the other one */
+  if (x == defaultfg)
+    xloadvariants(defaultbg, 1);
+  else if (x == defaultbg)
+    xloadvariants(defaultfg, 1);
 
   return 0;
 }
 
+/*
+ * Allocates the reverse and faint variants of palette entry i, so that
+ * drawing never allocates colors for palette glyphs. With reload the old
+ * ones are freed first.
+ */
+void xloadvariants(int i, int reload) {
+  XRenderColor c;
+  int var;
+
+  for (var = 1; var < COLOR_VARIANTS; var++) {
+    if (reload)
+      XftColorFree(xw.dpy, xw.vis, xw.cmap, &XCOLOR(i, var));
+    c = xcolorvariant(dc.col[i].color, i, var);
+    if (!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &c, &XCOLOR(i, var)))
+      die("Could not allocate a variant of color %d\n", i);
+  }
+}
+
+/*
+ * Color c as drawn with the variant var: reversed, the default colors
+ * into each other when c is palette entry i, and halved when faint.
+ */
+XRenderColor xcolorvariant(XRenderColor c, int i, int var) {
+  if (var & COLOR_REVERSE) {
+    if (i == defaultfg) {
+      c = dc.col[defaultbg].color;
+    } else if (i == defaultbg) {
+      c = dc.col[defaultfg].color;
+    } else {
+      c.red = ~c.red;
+      c.green = ~c.green;
+      c.blue = ~c.blue;
+    }
+  }
+  if (var & COLOR_FAINT) {
+    c.red /= 2;
+    c.green /= 2;
+    c.blue /= 2;
+  }
+  return c;
+}
+
+/* a palette index or truecolor of a glyph, as drawn with variant var */
+Color *xglyphcolor(uint32_t c, int var) {
+  XRenderColor col;
+
+  if (!IS_TRUECOL(c))
+    return &XCOLOR(c, var);
+  col.red = TRUERED(c);
+  col.green = TRUEGREEN(c);
+  col.blue = TRUEBLUE(c);
+  col.alpha = 0xffff;
+  col = xcolorvariant(col, -1, var);
+  return xcachecolor(&col);
+}
+
+/*
+ * Returns the allocated color c, allocating it when it isn't among the
+ * COLOR_CACHE colors used last; the one used longest ago makes room.
+ */
+Color *xcachecolor(const XRenderColor *c) {
+  uint64_t key = (uint64_t)c->red << 48 | (uint64_t)c->green << 32 |
+                 (uint64_t)c->blue << 16 | c->alpha;
+  auto it = colorcache.find(key);
+
+  if (it != colorcache.end()) {
+    colorlru.splice(colorlru.begin(), colorlru, it->second);
+    return &it->second->second;
+  }
+
+  if (colorcache.size() >= COLOR_CACHE) {
+    colorlru.splice(colorlru.begin(), colorlru, std::prev(colorlru.end()));
+    colorcache.erase(colorlru.front().first);
+    XftColorFree(xw.dpy, xw.vis, xw.cmap, &colorlru.front().second);
+  } else {
+    colorlru.emplace_front();
+  }
+  /* a full colormap draws the color in the default foreground */
+  if (!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, c,
+                          &colorlru.front().second)) {
+    colorlru.pop_front();
+    return &dc.col[defaultfg];
+  }
+  colorlru.front().first = key;
+  colorcache[key] = colorlru.begin();
+  return &colorlru.front().second;
+}
+
 /*
  * Absolute coordinates.
  */
 void xclear(int x1, int y1, int x2, int y2) {
-  XftDrawRect(xw.draw, &dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg],
+  XftDrawRect(xw.draw,
+              &dc.col[(dterm->mode & MODE_REVERSE) ? defaultfg : defaultbg],
               x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -626,6 +859,9 @@ double xfontsize() { return dc.font->metrics().pixel_size; }
 void xsetfontsize(double fontsize) {
   dc.font->SetPixelSize(fontsize);
   reloadmetrics();
+  xclearglyphs();
+  rs.glyphs.clear();
+  rs.fonts.clear();
 }
 
 void xinit(void) {
@@ -635,6 +871,9 @@ void xinit(void) {
   pid_t thispid = getpid();
   XColor xmousefg, xmousebg;
 
+  /* the reader thread sets titles, selections and the like */
+  if (threaded && !XInitThreads())
+    die("Xlib doesn't support threads\n");
   if (!(xw.dpy = XOpenDisplay(NULL)))
     die("Can't open display\n");
   xw.scr = XDefaultScreen(xw.dpy);
@@ -646,6 +885,7 @@ void xinit(void) {
   dc.font.reset(
       new MTFont(opt_font == nullptr ? font : opt_font, xw.dpy, xw.scr));
   reloadmetrics();
+  xclearglyphs();
   default_font_size = dc.font->metrics().pixel_size;
 
   /* colors */
@@ -687,6 +927,10 @@ void xinit(void) {
 
   /* Xft rendering context */
   xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+  if (rasterize && !xrasterinit()) {
+    fprintf(stderr, "mt: can't rasterize to this visual, drawing with Xft\n");
+    rasterize = 0;
+  }
 
   /* input methods */
   if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
@@ -741,6 +985,29 @@ void xinit(void) {
     xsel.xtarget = XA_STRING;
 }
 
+/* dc.font->FindGlyph, through the lookup cache */
+MTFont::Glyph xfindglyph(Rune u, int style) {
+  uint32_t key = u | (uint32_t)style << 24, h = key * 2654435761u;
+  GlyphSlot *s = u < 256 ? &glyphlatin[style << 8 | u]
+                         : &glyphslots[h >> (32 - GLYPH_BITS)];
+
+  if (s->key == key) {
+    ttystats.glyphhits++;
+    return s->glyph;
+  }
+  ttystats.glyphmisses++;
+  s->key = key;
+  s->glyph = dc.font->FindGlyph(u, static_cast<MTFont::Style>(style));
+  return s->glyph;
+}
+
+void xclearglyphs(void) {
+  for (GlyphSlot &s : glyphlatin)
+    s.key = ~0u;
+  for (GlyphSlot &s : glyphslots)
+    s.key = ~0u;
+}
+
 int xmakeglyphfontspecs(XftGlyphFontSpec *specs, const MTGlyph *glyphs, int len,
                         int x, int y) {
   float winx = borderpx + x * win.cw, winy = borderpx + y * win.ch, xp, yp;
@@ -750,10 +1017,9 @@ int xmakeglyphfontspecs(XftGlyphFontSpec *specs, const MTGlyph *glyphs, int len,
     if (mode == ATTR_WDUMMY)
       continue;
 
-    MTFont::Glyph glyph = dc.font->FindGlyph(
-        glyphs[i].u, static_cast<MTFont::Style>(
-                         ((mode & ATTR_BOLD) ? MTFont::BOLD : 0) |
-                         ((mode & ATTR_ITALIC) ? MTFont::ITALIC : 0)));
+    MTFont::Glyph glyph = xfindglyph(
+        glyphs[i].u, ((mode & ATTR_BOLD) ? MTFont::BOLD : 0) |
+                         ((mode & ATTR_ITALIC) ? MTFont::ITALIC : 0));
     specs[numspecs].glyph = glyph.index;
     specs[numspecs].font = glyph.font;
     specs[numspecs].x = (short)xp;
@@ -766,97 +1032,55 @@ int xmakeglyphfontspecs(XftGlyphFontSpec *specs, const MTGlyph *glyphs, int len,
   return numspecs;
 }
 
-void xdrawglyphfontspecs(const XftGlyphFontSpec *specs, MTGlyph base, int len,
-                         int x, int y) {
-  int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
-  int winx = borderpx + x * win.cw, winy = borderpx + y * win.ch,
-      width = charlen * win.cw;
-  Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
-  XRenderColor colfg, colbg;
-  XRectangle r;
-
-  if (IS_TRUECOL(base.fg)) {
-    colfg.alpha = 0xffff;
-    colfg.red = TRUERED(base.fg);
-    colfg.green = TRUEGREEN(base.fg);
-    colfg.blue = TRUEBLUE(base.fg);
-    XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
-    fg = &truefg;
-  } else {
-    fg = &dc.col[base.fg];
-  }
-
-  if (IS_TRUECOL(base.bg)) {
-    colbg.alpha = 0xffff;
-    colbg.green = TRUEGREEN(base.bg);
-    colbg.red = TRUERED(base.bg);
-    colbg.blue = TRUEBLUE(base.bg);
-    XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
-    bg = &truebg;
-  } else {
-    bg = &dc.col[base.bg];
-  }
+/*
+ * The colors of the glyphs drawn with base and color, fg is bg when they
+ * don't show.
+ */
+void xglyphcolors(MTGlyph base, MTColor color, Color **fg, Color **bg) {
+  uint32_t fgc = color.fg, bgc = color.bg;
+  int var = (dterm->mode & MODE_REVERSE) ? COLOR_REVERSE : 0;
+  int faint = (base.mode & ATTR_BOLD_FAINT) == ATTR_FAINT ? COLOR_FAINT : 0;
 
   /* Change basic system colors [0-7] to bright system colors [8-15] */
-  if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(base.fg, 0, 7))
-    fg = &dc.col[base.fg + 8];
+  if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(fgc, 0, 7))
+    fgc += 8;
 
-  if (IS_SET(MODE_REVERSE)) {
-    if (fg == &dc.col[defaultfg]) {
-      fg = &dc.col[defaultbg];
-    } else {
-      colfg.red = ~fg->color.red;
-      colfg.green = ~fg->color.green;
-      colfg.blue = ~fg->color.blue;
-      colfg.alpha = fg->color.alpha;
-      XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
-      fg = &revfg;
-    }
+  if (base.mode & ATTR_REVERSE)
+    std::swap(fgc, bgc);
 
-    if (bg == &dc.col[defaultbg]) {
-      bg = &dc.col[defaultfg];
-    } else {
-      colbg.red = ~bg->color.red;
-      colbg.green = ~bg->color.green;
-      colbg.blue = ~bg->color.blue;
-      colbg.alpha = bg->color.alpha;
-      XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &revbg);
-      bg = &revbg;
-    }
-  }
+  /* the variants are allocated along with the palette or cached */
+  *fg = xglyphcolor(fgc, var | faint);
+  *bg = xglyphcolor(bgc, var);
 
-  if (base.mode & ATTR_REVERSE) {
-    temp = fg;
-    fg = bg;
-    bg = temp;
-  }
+  if (base.mode & ATTR_BLINK && dterm->mode & MODE_BLINK)
+    *fg = *bg;
 
-  if ((base.mode & ATTR_BOLD_FAINT) == ATTR_FAINT) {
-    colfg.red = fg->color.red / 2;
-    colfg.green = fg->color.green / 2;
-    colfg.blue = fg->color.blue / 2;
-    XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
-    fg = &revfg;
-  }
+  if (base.mode & ATTR_INVISIBLE)
+    *fg = *bg;
+}
 
-  if (base.mode & ATTR_BLINK && term.mode & MODE_BLINK)
-    fg = bg;
+void xdrawglyphfontspecs(const XftGlyphFontSpec *specs, MTGlyph base,
+                         MTColor color, int len, int x, int y) {
+  int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
+  int winx = borderpx + x * win.cw, winy = borderpx + y * win.ch,
+      width = charlen * win.cw;
+  Color *fg, *bg;
+  XRectangle r;
 
-  if (base.mode & ATTR_INVISIBLE)
-    fg = bg;
+  xglyphcolors(base, color, &fg, &bg);
 
   /* Intelligent cleaning up of the borders. */
   if (x == 0) {
     xclear(0, (y == 0) ? 0 : winy, borderpx,
-           winy + win.ch + ((y >= term.row - 1) ? win.h : 0));
+           winy + win.ch + ((y >= dterm->row - 1) ? win.h : 0));
   }
-  if (x + charlen >= term.col) {
+  if (x + charlen >= dterm->col) {
     xclear(winx + width, (y == 0) ? 0 : winy, win.w,
-           ((y >= term.row - 1) ? win.h : (winy + win.ch)));
+           ((y >= dterm->row - 1) ? win.h : (winy + win.ch)));
   }
   if (y == 0)
     xclear(winx, 0, winx + width, borderpx);
-  if (y == term.row - 1)
+  if (y == dterm->row - 1)
     xclear(winx, winy + win.ch, winx + width, win.h);
 
   /* Clean up the region we want to draw to. */
@@ -887,66 +1111,584 @@ void xdrawglyphfontspecs(const XftGlyphFontSpec *specs, MTGlyph base, int len,
   XftDrawSetClip(xw.draw, 0);
 }
 
-void xdrawglyph(MTGlyph g, int x, int y) {
+/* The batch of the frame drawing in c, batches past frame.n are reused */
+DrawBatch *xbatch(const Color *c) {
+  const XRenderColor *a = &c->color;
+  uint64_t key = (uint64_t)a->red << 48 | (uint64_t)a->green << 32 |
+                 (uint64_t)a->blue << 16 | a->alpha;
+  DrawBatch *d;
+
+  auto it = frame.index.emplace(key, frame.n);
+  if (!it.second)
+    return &frame.batch[it.first->second];
+  if (frame.n == (int)frame.batch.size())
+    frame.batch.emplace_back();
+  d = &frame.batch[frame.n++];
+  d->color = *c;
+  d->fills.clear();
+  d->lines.clear();
+  d->specs.clear();
+  d->xft.clear();
+  d->rows.clear();
+  d->xftrows.clear();
+  return d;
+}
+
+/* Adds r to v, joined with the last rectangle when it continues it */
+void xbatchfill(std::vector<XRectangle> *v, XRectangle r) {
+  XRectangle *l = v->empty() ? NULL : &v->back();
+
+  if (l && l->y == r.y && l->height == r.height && l->x + l->width == r.x)
+    l->width += r.width;
+  else
+    v->push_back(r);
+}
+
+/* Joins the rectangles of v that continue each other downwards */
+void xjoinfills(std::vector<XRectangle> *v) {
+  size_t i, n = 0;
+
+  if (v->size() < 2)
+    return;
+  std::sort(v->begin(), v->end(), [](const XRectangle &a, const XRectangle &b) {
+    return a.x != b.x ? a.x < b.x : a.width != b.width ? a.width < b.width
+                                                        : a.y < b.y;
+  });
+  for (i = 1; i < v->size(); i++) {
+    XRectangle &l = (*v)[n], &r = (*v)[i];
+    if (l.x == r.x && l.width == r.width && l.y + l.height == r.y)
+      l.height += r.height;
+    else
+      (*v)[++n] = r;
+  }
+  v->resize(n + 1);
+}
+
+/*
+ * Sorts the columns lo to hi of row y into the batches of the frame, one per
+ * color. The backgrounds and the borders the row touches become fills, a row
+ * of blanks in the default colors a single one, and the lines are cut to the
+ * row. The clip of the row covers the cells and those borders.
+ */
+void xbatchrow(int y, int lo, int hi, int ena_sel) {
+  int x, i, k, end, charlen, numspecs;
+  int winx = borderpx + lo * win.cw, winy = borderpx + y * win.ch,
+      ascent = dc.font->metrics().ascent;
+  MTGlyph g;
+  Color *fg, *bg;
+  DrawBatch *b, *d;
+  XRectangle r, clip;
+
+  /* a wide glyph at the end is drawn whole */
+  end = hi + (dterm->line[y][hi - 1].mode & ATTR_WIDE ? 1 : 0);
+  clip.x = (lo == 0) ? 0 : winx;
+  clip.y = (y == 0) ? 0 : winy;
+  clip.width =
+      ((end >= dterm->col) ? win.w : borderpx + end * win.cw) - clip.x;
+  clip.height = ((y >= dterm->row - 1) ? win.h : winy + win.ch) - clip.y;
+  k = frame.rows.size();
+  frame.rows.push_back(clip);
+
+  /* the borders go around the cells, in line with them where they can */
+  d = xbatch(&dc.col[(dterm->mode & MODE_REVERSE) ? defaultfg : defaultbg]);
+  if (clip.y < winy)
+    d->fills.push_back({clip.x, clip.y, clip.width, (ushort)(winy - clip.y)});
+  if (clip.x < winx)
+    xbatchfill(&d->fills, {clip.x, (short)winy, (ushort)(winx - clip.x),
+                           (ushort)win.ch});
+
+  numspecs = xmakeglyphfontspecs(specbuf, &dterm->line[y][lo], hi - lo, lo, y);
+  for (x = lo, i = 0; x < hi && i < numspecs; x++) {
+    g = dterm->line[y][x];
+    if (g.mode == ATTR_WDUMMY)
+      continue;
+    if (ena_sel && selcontains(dsel, x, y))
+      g.mode ^= ATTR_REVERSE;
+    xglyphcolors(g, dterm->colors[g.color], &fg, &bg);
+    charlen = (g.mode & ATTR_WIDE) ? 2 : 1;
+
+    r.x = borderpx + x * win.cw;
+    r.y = winy;
+    r.width = charlen * win.cw;
+    r.height = win.ch;
+    xbatchfill(&xbatch(bg)->fills, r);
+
+    b = xbatch(fg);
+    if (fg != bg && g.u != ' ')
+      b->specs.push_back(specbuf[i]);
+    r.height = 1;
+    if (g.mode & ATTR_UNDERLINE && ascent + 1 < win.ch) {
+      r.y = winy + ascent + 1;
+      xbatchfill(&b->lines, r);
+    }
+    if (g.mode & ATTR_STRUCK) {
+      r.y = winy + 2 * ascent / 3;
+      xbatchfill(&b->lines, r);
+    }
+    i++;
+  }
+
+  d = xbatch(&dc.col[(dterm->mode & MODE_REVERSE) ? defaultfg : defaultbg]);
+  x = borderpx + end * win.cw;
+  if (clip.x + clip.width > x)
+    xbatchfill(&d->fills, {(short)x, (short)winy,
+                           (ushort)(clip.x + clip.width - x), (ushort)win.ch});
+  if (clip.y + clip.height > winy + win.ch)
+    d->fills.push_back({clip.x, (short)(winy + win.ch), clip.width,
+                        (ushort)(clip.y + clip.height - winy - win.ch)});
+
+  for (i = 0; i < frame.n; i++) {
+    b = &frame.batch[i];
+    if (b->specs.size() > (b->rows.empty() ? 0 : b->rows.back().second))
+      b->rows.push_back({k, b->specs.size()});
+  }
+}
+
+/*
+ * Draws the batches of the frame: all backgrounds with one fill per color,
+ * the glyphs of each row within its clip with one composite per color, then
+ * the lines. The glyphs come from the glyph sets Xft uploads to the server
+ * once per font, rather than from glyph sets of our own. The requests this
+ * sends are counted in ttystats.requests, see floodstats.
+ */
+void xdrawframe(void) {
+  Picture dst = XftDrawPicture(xw.draw);
+  std::vector<size_t> next(frame.n);
+  DrawBatch *b;
+  size_t k, start;
+  int i;
+
+  for (i = 0; i < frame.n; i++) {
+    b = &frame.batch[i];
+    xjoinfills(&b->fills);
+    if (!b->fills.empty())
+      XRenderFillRectangles(xw.dpy, PictOpSrc, dst, &b->color.color,
+                            b->fills.data(), b->fills.size());
+  }
+  for (k = 0; k < frame.rows.size(); k++) {
+    XftDrawSetClipRectangles(xw.draw, 0, 0, &frame.rows[k], 1);
+    for (i = 0; i < frame.n; i++) {
+      b = &frame.batch[i];
+      if (next[i] == b->rows.size() || b->rows[next[i]].first != (int)k)
+        continue;
+      start = next[i] ? b->rows[next[i] - 1].second : 0;
+      XftGlyphFontSpecRender(xw.dpy, PictOpOver,
+                             XftDrawSrcPicture(xw.draw, &b->color), dst, 0, 0,
+                             &b->specs[start], b->rows[next[i]].second - start);
+      next[i]++;
+    }
+  }
+  XftDrawSetClip(xw.draw, 0);
+  for (i = 0; i < frame.n; i++) {
+    b = &frame.batch[i];
+    if (!b->lines.empty())
+      XRenderFillRectangles(xw.dpy, PictOpSrc, dst, &b->color.color,
+                            b->lines.data(), b->lines.size());
+  }
+}
+
+/*
+ * The rasterizer draws rows into a client-side image instead, blending the
+ * glyphs from masks it renders with FreeType, and uploads the rectangles it
+ * drew. The image is shared with the server through MIT-SHM when the server
+ * is local, otherwise each upload is an XPutImage. It takes a TrueColor
+ * visual with 8 bit channels in 32 bit pixels.
+ */
+int xrasterinit(void) {
+  if (xw.vis->c_class != TrueColor || xw.vis->red_mask != 0xff0000 ||
+      xw.vis->green_mask != 0xff00 || xw.vis->blue_mask != 0xff)
+    return 0;
+  rs.useshm = XShmQueryExtension(xw.dpy);
+  xrasterresize();
+  return rs.img != NULL;
+}
+
+static int shmfailed;
+static int xshmerror(Display *, XErrorEvent *) {
+  shmfailed = 1;
+  return 0;
+}
+
+/* (Re)creates the image at the size of the window */
+void xrasterresize(void) {
+  int (*handler)(Display *, XErrorEvent *);
+  int depth = DefaultDepth(xw.dpy, xw.scr);
+
+  if (rs.img && rs.useshm) {
+    XShmDetach(xw.dpy, &rs.shm);
+    XSync(xw.dpy, False);
+    shmdt(rs.shm.shmaddr);
+    rs.img->data = NULL;
+  }
+  if (rs.img)
+    XDestroyImage(rs.img);
+  rs.img = NULL;
+  rs.busy = 0;
+  rs.damage.clear();
+
+  while (rs.useshm) {
+    rs.img = XShmCreateImage(xw.dpy, xw.vis, depth, ZPixmap, NULL, &rs.shm,
+                             win.w, win.h);
+    if (!rs.img)
+      break;
+    rs.shm.shmid = shmget(IPC_PRIVATE, rs.img->bytes_per_line * rs.img->height,
+                          IPC_CREAT | 0600);
+    if (rs.shm.shmid < 0)
+      break;
+    rs.shm.shmaddr = rs.img->data =
+        static_cast<char *>(shmat(rs.shm.shmid, NULL, 0));
+    shmctl(rs.shm.shmid, IPC_RMID, NULL);
+    if (rs.shm.shmaddr == (char *)-1)
+      break;
+    rs.shm.readOnly = True;
+
+    /* attaching fails for remote servers that claim the extension */
+    shmfailed = 0;
+    handler = XSetErrorHandler(xshmerror);
+    XShmAttach(xw.dpy, &rs.shm);
+    XSync(xw.dpy, False);
+    XSetErrorHandler(handler);
+    if (!shmfailed && rs.img->bits_per_pixel == 32)
+      return;
+    if (!shmfailed)
+      XShmDetach(xw.dpy, &rs.shm);
+    shmdt(rs.shm.shmaddr);
+    break;
+  }
+  if (rs.img) {
+    rs.img->data = NULL;
+    XDestroyImage(rs.img);
+  }
+  rs.useshm = 0;
+
+  rs.img = XCreateImage(xw.dpy, xw.vis, depth, ZPixmap, 0, NULL, win.w, win.h,
+                        32, 0);
+  if (!rs.img)
+    return;
+  if (rs.img->bits_per_pixel != 32) {
+    XDestroyImage(rs.img);
+    rs.img = NULL;
+    return;
+  }
+  rs.img->data =
+      static_cast<char *>(malloc(rs.img->bytes_per_line * rs.img->height));
+  if (!rs.img->data)
+    die("Out of memory\n");
+}
+
+/* Uploads what was drawn into the image */
+void xrasterflush(void) {
+  for (const XRectangle &d : rs.damage) {
+    if (rs.useshm) {
+      XShmPutImage(xw.dpy, xw.buf, dc.gc, rs.img, d.x, d.y, d.x, d.y, d.width,
+                   d.height, False);
+      rs.busy = 1;
+    } else {
+      XPutImage(xw.dpy, xw.buf, dc.gc, rs.img, d.x, d.y, d.x, d.y, d.width,
+                d.height);
+    }
+  }
+  rs.damage.clear();
+}
+
+/* The mask of glyph index of font, rendered the way Xft renders it */
+const GlyphMask *xrasterglyph(XftFont *font, FT_UInt index) {
+  uint64_t key;
+  size_t f;
+  FT_Face face;
+  FT_Bitmap *bm;
+  FcBool aa = FcTrue, hinting = FcTrue, autohint = FcFalse, bold = FcFalse;
+  int hintstyle = FC_HINT_FULL, flags = FT_LOAD_DEFAULT, x, y;
+
+  f = std::find(rs.fonts.begin(), rs.fonts.end(), font) - rs.fonts.begin();
+  if (f == rs.fonts.size())
+    rs.fonts.push_back(font);
+  key = (uint64_t)f << 32 | index;
+  auto it = rs.glyphs.find(key);
+  if (it != rs.glyphs.end())
+    return &it->second;
+
+  GlyphMask &g = rs.glyphs[key];
+  g.xft = 1;
+  if (!(face = XftLockFace(font)))
+    return &g;
+  if (FT_HAS_COLOR(face)) {
+    XftUnlockFace(font);
+    return &g;
+  }
+
+  FcPatternGetBool(font->pattern, FC_ANTIALIAS, 0, &aa);
+  FcPatternGetBool(font->pattern, FC_HINTING, 0, &hinting);
+  FcPatternGetInteger(font->pattern, FC_HINT_STYLE, 0, &hintstyle);
+  FcPatternGetBool(font->pattern, FC_AUTOHINT, 0, &autohint);
+  FcPatternGetBool(font->pattern, FC_EMBOLDEN, 0, &bold);
+  if (!hinting || hintstyle == FC_HINT_NONE)
+    flags |= FT_LOAD_NO_HINTING;
+  else if (!aa)
+    flags |= FT_LOAD_TARGET_MONO;
+  else if (hintstyle == FC_HINT_SLIGHT)
+    flags |= FT_LOAD_TARGET_LIGHT;
+  if (autohint)
+    flags |= FT_LOAD_FORCE_AUTOHINT;
+
+  if (!FT_Load_Glyph(face, index, flags)) {
+    if (bold)
+      FT_GlyphSlot_Embolden(face->glyph);
+    if (!FT_Render_Glyph(face->glyph,
+                         aa ? FT_RENDER_MODE_NORMAL : FT_RENDER_MODE_MONO)) {
+      bm = &face->glyph->bitmap;
+      if (bm->pixel_mode == FT_PIXEL_MODE_GRAY ||
+          bm->pixel_mode == FT_PIXEL_MODE_MONO) {
+        g.xft = 0;
+        g.left = face->glyph->bitmap_left;
+        g.top = face->glyph->bitmap_top;
+        g.w = bm->width;
+        g.h = bm->rows;
+        g.mask.resize(g.w * g.h);
+        for (y = 0; y < g.h; y++) {
+          const uint8_t *row = bm->buffer + y * bm->pitch;
+          for (x = 0; x < g.w; x++) {
+            g.mask[y * g.w + x] = bm->pixel_mode == FT_PIXEL_MODE_GRAY
+                                      ? row[x]
+                                      : (row[x >> 3] & (0x80 >> (x & 7))) ? 255
+                                                                          : 0;
+          }
+        }
+      }
+    }
+  }
+  XftUnlockFace(font);
+  return &g;
+}
+
+/* Fills rectangle r of the image */
+void xrasterfill(uint32_t pixel, const XRectangle *r) {
+  int y;
+  char *row;
+
+  for (y = r->y; y < r->y + r->height; y++) {
+    row = rs.img->data + y * rs.img->bytes_per_line;
+    std::fill_n(reinterpret_cast<uint32_t *>(row) + r->x, r->width, pixel);
+  }
+}
+
+#ifdef __SSE2__
+/* x * a / 255 in 16 bit lanes, rounded like the X server does */
+static inline __m128i mulun8(__m128i x, __m128i a) {
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, a), _mm_set1_epi16(0x80));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+/*
+ * Blends fg over n pixels through the mask: fg * a + dst * (1 - a) per
+ * channel, with the rounding of the X server, 4 pixels at a time with SSE2.
+ */
+void xrasterblend(uint32_t *dst, const uint8_t *mask, int n, uint32_t fg) {
+  int i = 0;
+  uint32_t a, d, c, t, out;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128(), k255 = _mm_set1_epi16(255);
+  const __m128i f = _mm_unpacklo_epi8(_mm_set1_epi32(fg), zero);
+  __m128i dv, ma, alo, ahi, lo, hi;
+
+  for (; i + 4 <= n; i += 4) {
+    memcpy(&a, mask + i, 4);
+    if (!a)
+      continue;
+    dv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+    ma = _mm_cvtsi32_si128(a);
+    ma = _mm_unpacklo_epi8(ma, ma);
+    ma = _mm_unpacklo_epi16(ma, ma);
+    alo = _mm_unpacklo_epi8(ma, zero);
+    ahi = _mm_unpackhi_epi8(ma, zero);
+    lo = _mm_unpacklo_epi8(dv, zero);
+    hi = _mm_unpackhi_epi8(dv, zero);
+    lo = _mm_add_epi16(mulun8(f, alo),
+                       mulun8(lo, _mm_sub_epi16(k255, alo)));
+    hi = _mm_add_epi16(mulun8(f, ahi),
+                       mulun8(hi, _mm_sub_epi16(k255, ahi)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packus_epi16(lo, hi));
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (!(a = mask[i]))
+      continue;
+    d = dst[i];
+    out = 0;
+    for (c = 0; c < 32; c += 8) {
+      t = ((fg >> c) & 0xff) * a + 0x80;
+      out += ((t + (t >> 8)) >> 8) << c;
+      t = ((d >> c) & 0xff) * (255 - a) + 0x80;
+      out += ((t + (t >> 8)) >> 8) << c;
+    }
+    dst[i] = out;
+  }
+}
+
+/*
+ * Draws the batches of the frame into the image, in the order and within the
+ * clips of xdrawframe, and uploads the rows. Glyphs the rasterizer can't draw
+ * are composited by Xft after the upload.
+ */
+void xrasterframe(void) {
+  std::vector<size_t> next(frame.n);
+  DrawBatch *b;
+  const GlyphMask *m;
+  size_t k, j, start;
+  int i, gx, gy, x0, x1, y0, y1, xft = 0;
+
+  /* bound the masks, the pointers to them only live within a frame */
+  if (rs.glyphs.size() >= RASTER_GLYPHS) {
+    rs.glyphs.clear();
+    rs.fonts.clear();
+  }
+
+  /* the server reads the segment after the requests uploading it */
+  if (rs.busy) {
+    XSync(xw.dpy, False);
+    rs.busy = 0;
+  }
+
+  for (i = 0; i < frame.n; i++) {
+    b = &frame.batch[i];
+    for (const XRectangle &f : b->fills)
+      xrasterfill(b->color.pixel, &f);
+  }
+  for (k = 0; k < frame.rows.size(); k++) {
+    const XRectangle &r = frame.rows[k];
+    for (i = 0; i < frame.n; i++) {
+      b = &frame.batch[i];
+      if (next[i] == b->rows.size() || b->rows[next[i]].first != (int)k)
+        continue;
+      start = next[i] ? b->rows[next[i] - 1].second : 0;
+      for (j = start; j < b->rows[next[i]].second; j++) {
+        const XftGlyphFontSpec &s = b->specs[j];
+        if (!s.font)
+          continue;
+        m = xrasterglyph(s.font, s.glyph);
+        if (m->xft) {
+          b->xft.push_back(s);
+          continue;
+        }
+        gx = s.x + m->left;
+        gy = s.y - m->top;
+        x0 = MAX(gx, r.x);
+        x1 = MIN(gx + m->w, r.x + r.width);
+        y0 = MAX(gy, r.y);
+        y1 = MIN(gy + m->h, r.y + r.height);
+        for (; x0 < x1 && y0 < y1; y0++) {
+          xrasterblend(reinterpret_cast<uint32_t *>(
+                           rs.img->data + y0 * rs.img->bytes_per_line) +
+                           x0,
+                       &m->mask[(y0 - gy) * m->w + x0 - gx], x1 - x0,
+                       b->color.pixel);
+        }
+      }
+      next[i]++;
+      if (b->xft.size() > (b->xftrows.empty() ? 0 : b->xftrows.back().second)) {
+        b->xftrows.push_back({(int)k, b->xft.size()});
+        xft = 1;
+      }
+    }
+
+    /* rows below each other with the same span go up as one image */
+    if (!rs.damage.empty() && rs.damage.back().x == r.x &&
+        rs.damage.back().width == r.width &&
+        rs.damage.back().y + rs.damage.back().height == r.y)
+      rs.damage.back().height += r.height;
+    else
+      rs.damage.push_back(r);
+  }
+  for (i = 0; i < frame.n; i++) {
+    b = &frame.batch[i];
+    for (const XRectangle &l : b->lines)
+      xrasterfill(b->color.pixel, &l);
+  }
+  xrasterflush();
+  if (!xft)
+    return;
+
+  std::fill(next.begin(), next.end(), 0);
+  for (k = 0; k < frame.rows.size(); k++) {
+    XftDrawSetClipRectangles(xw.draw, 0, 0, &frame.rows[k], 1);
+    for (i = 0; i < frame.n; i++) {
+      b = &frame.batch[i];
+      if (next[i] == b->xftrows.size() || b->xftrows[next[i]].first != (int)k)
+        continue;
+      start = next[i] ? b->xftrows[next[i] - 1].second : 0;
+      XftDrawGlyphFontSpec(xw.draw, &b->color, &b->xft[start],
+                           b->xftrows[next[i]].second - start);
+      next[i]++;
+    }
+  }
+  XftDrawSetClip(xw.draw, 0);
+}
+
+void xdrawglyph(MTGlyph g, MTColor color, int x, int y) {
   int numspecs;
   XftGlyphFontSpec spec;
 
   numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y);
-  xdrawglyphfontspecs(&spec, g, numspecs, x, y);
+  xdrawglyphfontspecs(&spec, g, color, numspecs, x, y);
 }
 
 void xdrawcursor(void) {
-  static int oldx = 0, oldy = 0;
   int curx;
-  MTGlyph g = {' ', ATTR_NULL, defaultbg, defaultcs}, og;
-  int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+  MTGlyph g = {' ', ATTR_NULL, 0}, og;
+  MTColor gc = {defaultbg, defaultcs};
+  int ena_sel = dsel->ob.x != -1 &&
+                dsel->alt == !!(dterm->mode & MODE_ALTSCREEN);
   Color drawcol;
 
-  LIMIT(oldx, 0, term.col - 1);
-  LIMIT(oldy, 0, term.row - 1);
+  LIMIT(oldx, 0, dterm->col - 1);
+  LIMIT(oldy, 0, dterm->row - 1);
 
-  curx = term.c.x;
+  curx = dterm->c.x;
 
   /* adjust position if in dummy */
-  if (term.line[oldy][oldx].mode & ATTR_WDUMMY)
+  if (dterm->line[oldy][oldx].mode & ATTR_WDUMMY)
     oldx--;
-  if (term.line[term.c.y][curx].mode & ATTR_WDUMMY)
+  if (dterm->line[dterm->c.y][curx].mode & ATTR_WDUMMY)
     curx--;
 
   /* remove the old cursor */
-  og = term.line[oldy][oldx];
-  if (ena_sel && selected(oldx, oldy))
+  og = dterm->line[oldy][oldx];
+  if (ena_sel && selcontains(dsel, oldx, oldy))
     og.mode ^= ATTR_REVERSE;
-  xdrawglyph(og, oldx, oldy);
+  xdrawglyph(og, dterm->colors[og.color], oldx, oldy);
 
-  g.u = term.line[term.c.y][term.c.x].u;
-  g.mode |= term.line[term.c.y][term.c.x].mode &
+  g.u = dterm->line[dterm->c.y][dterm->c.x].u;
+  g.mode |= dterm->line[dterm->c.y][dterm->c.x].mode &
             (ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_STRUCK);
 
   /*
    * Select the right color for the right mode.
    */
-  if (IS_SET(MODE_REVERSE)) {
+  if (dterm->mode & MODE_REVERSE) {
     g.mode |= ATTR_REVERSE;
-    g.bg = defaultfg;
-    if (ena_sel && selected(term.c.x, term.c.y)) {
+    gc.bg = defaultfg;
+    if (ena_sel && selcontains(dsel, dterm->c.x, dterm->c.y)) {
       drawcol = dc.col[defaultcs];
-      g.fg = defaultrcs;
+      gc.fg = defaultrcs;
     } else {
       drawcol = dc.col[defaultrcs];
-      g.fg = defaultcs;
+      gc.fg = defaultcs;
     }
   } else {
-    if (ena_sel && selected(term.c.x, term.c.y)) {
+    if (ena_sel && selcontains(dsel, dterm->c.x, dterm->c.y)) {
       drawcol = dc.col[defaultrcs];
-      g.fg = defaultfg;
-      g.bg = defaultrcs;
+      gc.fg = defaultfg;
+      gc.bg = defaultrcs;
     } else {
       drawcol = dc.col[defaultcs];
     }
   }
 
-  if (IS_SET(MODE_HIDE))
+  if (dterm->mode & MODE_HIDE)
     return;
 
   /* draw the new one */
@@ -957,32 +1699,32 @@ void xdrawcursor(void) {
     case 0: /* Blinking Block */
     case 1: /* Blinking Block (Default) */
     case 2: /* Steady Block */
-      g.mode |= term.line[term.c.y][curx].mode & ATTR_WIDE;
-      xdrawglyph(g, term.c.x, term.c.y);
+      g.mode |= dterm->line[dterm->c.y][curx].mode & ATTR_WIDE;
+      xdrawglyph(g, gc, dterm->c.x, dterm->c.y);
       break;
     case 3: /* Blinking Underline */
     case 4: /* Steady Underline */
       XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                  borderpx + (term.c.y + 1) * win.ch - cursorthickness, win.cw,
-                  cursorthickness);
+                  borderpx + (dterm->c.y + 1) * win.ch - cursorthickness,
+                  win.cw, cursorthickness);
       break;
     case 5: /* Blinking bar */
     case 6: /* Steady bar */
       XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                  borderpx + term.c.y * win.ch, cursorthickness, win.ch);
+                  borderpx + dterm->c.y * win.ch, cursorthickness, win.ch);
       break;
     }
   } else {
     XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                borderpx + term.c.y * win.ch, win.cw - 1, 1);
+                borderpx + dterm->c.y * win.ch, win.cw - 1, 1);
     XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                borderpx + term.c.y * win.ch, 1, win.ch - 1);
+                borderpx + dterm->c.y * win.ch, 1, win.ch - 1);
     XftDrawRect(xw.draw, &drawcol, borderpx + (curx + 1) * win.cw - 1,
-                borderpx + term.c.y * win.ch, 1, win.ch - 1);
+                borderpx + dterm->c.y * win.ch, 1, win.ch - 1);
     XftDrawRect(xw.draw, &drawcol, borderpx + curx * win.cw,
-                borderpx + (term.c.y + 1) * win.ch - 1, win.cw, 1);
+                borderpx + (dterm->c.y + 1) * win.ch - 1, win.cw, 1);
   }
-  oldx = curx, oldy = term.c.y;
+  oldx = curx, oldy = dterm->c.y;
 }
 
 void xsetenv(void) {
@@ -1004,39 +1746,86 @@ void xsettitle(const char *p) {
 }
 
 void draw(void) {
-  drawregion(0, 0, term.col, term.row);
+  /*
+   * The snapshot is taken before drawlock: the reader thread holds the
+   * terminal lock while parsing and takes drawlock for palette changes.
+   */
+  if (threaded) {
+    tlock();
+    tsnapshot(&snapterm, &snapsel);
+    tunlock();
+  } else {
+    /* the history is only shown through a snapshot */
+    dterm = term.view ? &snapterm : &term;
+    dsel = term.view ? &snapsel : &sel;
+    if (term.view)
+      tsnapshot(&snapterm, &snapsel);
+  }
+
+  std::lock_guard<std::mutex> lock(drawlock);
+  drawregion(0, 0, dterm->col, dterm->row);
   XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, win.w, win.h, 0, 0);
-  XSetForeground(xw.dpy, dc.gc,
-                 dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg].pixel);
+  XSetForeground(
+      xw.dpy, dc.gc,
+      dc.col[(dterm->mode & MODE_REVERSE) ? defaultfg : defaultbg].pixel);
 }
 
 void drawregion(int x1, int y1, int x2, int y2) {
-  int i, x, y, ox, numspecs;
+  int i, x, y, ox, lo, hi, numspecs;
   MTGlyph base, changed;
   XftGlyphFontSpec *specs;
-  int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+  LineScroll *s = &dterm->scroll;
+  int ena_sel =
+      dsel->ob.x != -1 && dsel->alt == !!(dterm->mode & MODE_ALTSCREEN);
 
   if (!(win.state & WIN_VISIBLE))
     return;
 
+  /* scrolled rows are moved in the buffer, along with the cursor drawn there */
+  if (s->n) {
+    i = abs(s->n);
+    XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc, 0,
+              borderpx + (s->n > 0 ? s->top + i : s->top) * win.ch, win.w,
+              (s->bot - s->top + 1 - i) * win.ch, 0,
+              borderpx + (s->n > 0 ? s->top : s->top + i) * win.ch);
+    if (BETWEEN(oldy, s->top, s->bot))
+      oldy -= s->n;
+    s->n = 0;
+  }
+
+  frame.n = 0;
+  frame.index.clear();
+  frame.rows.clear();
   for (y = y1; y < y2; y++) {
-    if (!term.dirty[y])
+    if (!DIRTY(dterm->dirty[y]))
       continue;
 
-    term.dirty[y] = 0;
+    /* only the changed columns, from the start of a wide glyph they cut */
+    lo = MAX(dterm->dirty[y].x1, x1);
+    hi = MIN(dterm->dirty[y].x2 + 1, x2);
+    DIRTYCLEAR(dterm->dirty[y]);
+    if (lo >= hi)
+      continue;
+    if (lo > 0 && dterm->line[y][lo].mode & ATTR_WDUMMY)
+      lo--;
 
-    specs = term.specbuf;
-    numspecs = xmakeglyphfontspecs(specs, &term.line[y][x1], x2 - x1, x1, y);
+    if (rasterize || (renderrows && XftDrawPicture(xw.draw))) {
+      xbatchrow(y, lo, hi, ena_sel);
+      continue;
+    }
+
+    specs = specbuf;
+    numspecs = xmakeglyphfontspecs(specs, &dterm->line[y][lo], hi - lo, lo, y);
 
     i = ox = 0;
-    for (x = x1; x < x2 && i < numspecs; x++) {
-      changed = term.line[y][x];
+    for (x = lo; x < hi && i < numspecs; x++) {
+      changed = dterm->line[y][x];
       if (changed.mode == ATTR_WDUMMY)
         continue;
-      if (ena_sel && selected(x, y))
+      if (ena_sel && selcontains(dsel, x, y))
         changed.mode ^= ATTR_REVERSE;
       if (i > 0 && ATTRCMP(base, changed)) {
-        xdrawglyphfontspecs(specs, base, i, ox, y);
+        xdrawglyphfontspecs(specs, base, dterm->colors[base.color], i, ox, y);
         specs += i;
         numspecs -= i;
         i = 0;
@@ -1048,8 +1837,12 @@ void drawregion(int x1, int y1, int x2, int y2) {
       i++;
     }
     if (i > 0)
-      xdrawglyphfontspecs(specs, base, i, ox, y);
+      xdrawglyphfontspecs(specs, base, dterm->colors[base.color], i, ox, y);
   }
+  if (rasterize && !frame.rows.empty())
+    xrasterframe();
+  else if (!frame.rows.empty())
+    xdrawframe();
   xdrawcursor();
 }
 
@@ -1173,13 +1966,85 @@ void resize(XEvent *e) {
   ttyresize();
 }
 
+/*
+ * Handles all queued X events. The terminal is locked because handlers
+ * select, write input and resize.
+ */
+static void xevents(void) {
+  XEvent ev;
+
+  tlock();
+  while (XPending(xw.dpy)) {
+    XNextEvent(xw.dpy, &ev);
+    if (XFilterEvent(&ev, None))
+      continue;
+    handle(&ev);
+  }
+  tunlock();
+}
+
+/*
+ * Flood mode: tells whether program output arrives faster than floodbytes
+ * per second. ttyready is whether the pty had data this round, the flood
+ * ends when it had none for FLOOD_IDLE ms.
+ */
+static int xflood(int ttyready, struct timespec *now) {
+  static int flood;
+  static struct timespec window, start, ready;
+  static TtyStats base;
+  static uint64_t windowbytes;
+  TtyStats stats;
+  double dt, rate;
+  uint64_t hits, lookups;
+
+  tlock();
+  stats = ttystats;
+  tunlock();
+
+  if (ttyready)
+    ready = *now;
+  dt = TIMEDIFF((*now), window);
+  rate = dt > 0 ? (stats.bytes - windowbytes) * 1000 / dt : 0;
+  if (!flood && ttyready && dt >= FLOOD_WINDOW && rate >= floodbytes) {
+    flood = 1;
+    start = *now;
+    base = stats;
+  } else if (flood && (TIMEDIFF((*now), ready) >= FLOOD_IDLE ||
+                        (dt >= FLOOD_WINDOW && rate < floodbytes))) {
+    flood = 0;
+    if (floodstats) {
+      dt = TIMEDIFF((*now), start);
+      hits = stats.glyphhits - base.glyphhits;
+      lookups = hits + stats.glyphmisses - base.glyphmisses;
+      fprintf(stderr,
+              "flood: %.0f ms, %llu bytes (%.1f MB/s), %llu frames, "
+              "parse %.0f ms, draw %.0f ms, %llu requests, "
+              "%llu glyph lookups (%.1f%% cached)\n",
+              dt, (unsigned long long)(stats.bytes - base.bytes),
+              (stats.bytes - base.bytes) / dt / 1000,
+              (unsigned long long)(stats.frames - base.frames),
+              stats.parsems - base.parsems, stats.drawms - base.drawms,
+              (unsigned long long)(stats.requests - base.requests),
+              (unsigned long long)lookups,
+              lookups ? 100.0 * hits / lookups : 100.0);
+    }
+  }
+  if (dt >= FLOOD_WINDOW) {
+    window = *now;
+    windowbytes = stats.bytes;
+  }
+  return flood;
+}
+
 void run(void) {
   XEvent ev;
   int w = win.w, h = win.h;
-  fd_set rfd;
-  int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
-  struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
-  long deltatime;
+  fd_set rfd, wfd;
+  int xfd = XConnectionNumber(xw.dpy), ttyfd, xev, blinkset = 0, dodraw = 0;
+  int syncing, flood = 0, wasflood;
+  struct timespec drawtimeout, *tv = NULL, now, last, lastblink, t0, t1;
+  long deltatime, idlewait, statewait;
+  unsigned long req;
 
   /* Waiting for window mapping */
   do {
@@ -1201,63 +2066,108 @@ void run(void) {
   ttynew();
   ttyresize();
 
+  /* in threaded mode ttyfd only signals that the reader thread parsed */
+  ttyfd = cmdfd;
+  if (threaded) {
+    dterm = &snapterm;
+    dsel = &snapsel;
+    ttyfd = ttystart();
+  }
+
   clock_gettime(CLOCK_MONOTONIC, &last);
   lastblink = last;
 
   for (xev = actionfps;;) {
     FD_ZERO(&rfd);
-    FD_SET(cmdfd, &rfd);
+    FD_ZERO(&wfd);
+    FD_SET(ttyfd, &rfd);
     FD_SET(xfd, &rfd);
+    /* replies queued while parsing wait for room in the pty */
+    if (!threaded && ttyqueued())
+      FD_SET(cmdfd, &wfd);
 
-    if (pselect(MAX(xfd, cmdfd) + 1, &rfd, NULL, NULL, tv, NULL) < 0) {
+    if (pselect(MAX(xfd, ttyfd) + 1, &rfd, &wfd, NULL, tv, NULL) < 0) {
       if (errno == EINTR)
         continue;
       die("select failed: %s\n", strerror(errno));
     }
-    if (FD_ISSET(cmdfd, &rfd)) {
-      ttyread();
+    if (FD_ISSET(cmdfd, &wfd))
+      ttyflushq();
+
+    /*
+     * Input is handled as soon as it arrives, only frames wait for floods
+     * and synchronized updates. It goes first so that a ^C typed into a
+     * flood reaches the child before the next buffer is parsed, and an
+     * unread X socket would keep pselect() from waiting.
+     */
+    if (FD_ISSET(xfd, &rfd)) {
+      xev = actionfps;
+      xevents();
+    }
+
+    if (FD_ISSET(ttyfd, &rfd)) {
+      tlock();
+      if (threaded)
+        ttyack();
+      else
+        ttyread();
       if (blinktimeout) {
         blinkset = tattrset(ATTR_BLINK);
         if (!blinkset)
           MODBIT(term.mode, 0, MODE_BLINK);
       }
+      tunlock();
     }
 
-    if (FD_ISSET(xfd, &rfd))
-      xev = actionfps;
-
     clock_gettime(CLOCK_MONOTONIC, &now);
     drawtimeout.tv_sec = 0;
     drawtimeout.tv_nsec = (1000 * 1E6) / xfps;
     tv = &drawtimeout;
 
     dodraw = 0;
+    tlock();
+    syncing = tsyncing();
+    idlewait = taltidle(&now);
+    statewait = tstatesave(&now);
+    if (idlewait < 0 || (statewait >= 0 && statewait < idlewait))
+      idlewait = statewait;
     if (blinktimeout && TIMEDIFF(now, lastblink) > blinktimeout) {
       tsetdirtattr(ATTR_BLINK);
       term.mode ^= MODE_BLINK;
       lastblink = now;
       dodraw = 1;
     }
+    tunlock();
+    /* once a flood stops its final state is drawn right away */
+    wasflood = flood;
+    if ((flood = xflood(FD_ISSET(ttyfd, &rfd), &now)) < wasflood)
+      last.tv_sec = 0;
     deltatime = TIMEDIFF(now, last);
-    if (deltatime > 1000 / (xev ? xfps : actionfps)) {
+    if (deltatime > 1000 / (flood ? floodfps : xev ? xfps : actionfps)) {
       dodraw = 1;
       last = now;
     }
 
-    if (dodraw) {
-      while (XPending(xw.dpy)) {
-        XNextEvent(xw.dpy, &ev);
-        if (XFilterEvent(&ev, None))
-          continue;
-        handle(&ev);
-      }
-
+    /*
+     * Frames of a synchronized update are held back, the timer keeps
+     * running so the end of the update or its timeout is drawn.
+     */
+    if (dodraw && syncing) {
+      last.tv_sec = 0;
+    } else if (dodraw) {
+      xevents();
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      req = XNextRequest(xw.dpy);
       draw();
+      ttystats.requests += XNextRequest(xw.dpy) - req;
       XFlush(xw.dpy);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      ttystats.frames++;
+      ttystats.drawms += TIMEDIFF(t1, t0);
 
       if (xev && !FD_ISSET(xfd, &rfd))
         xev--;
-      if (!FD_ISSET(cmdfd, &rfd) && !FD_ISSET(xfd, &rfd)) {
+      if (!flood && !FD_ISSET(ttyfd, &rfd) && !FD_ISSET(xfd, &rfd)) {
         if (blinkset) {
           if (TIMEDIFF(now, lastblink) > blinktimeout) {
             drawtimeout.tv_nsec = 1000;
@@ -1267,6 +2177,10 @@ void run(void) {
           }
           drawtimeout.tv_sec = drawtimeout.tv_nsec / 1E9;
           drawtimeout.tv_nsec %= (long)1E9;
+        } else if (idlewait >= 0) {
+          /* wake up to free the alternate screen or save the state */
+          drawtimeout.tv_sec = idlewait / 1000;
+          drawtimeout.tv_nsec = idlewait % 1000 * 1E6;
         } else {
           tv = NULL;
         }
@@ -1282,8 +2196,9 @@ int main(int argc, char *argv[]) {
 
   auto usage = [&]{
     fprintf(stderr,
-R"(usage: %s [-iv] [-c class] [-f font] [-g geometry] [-n name] [-o file]
-            [-T title] [-t title] [-w windowid] [[-e] command [args ...]]
+R"(usage: %s [-irv] [-c class] [-f font] [-g geometry] [-n name] [-o file]
+            [-s session] [-T title] [-t title] [-w windowid]
+            [[-e] command [args ...]]
 )", argv[0]);
   };
   int argi, argj;  // Index and character being processed.
@@ -1328,9 +2243,15 @@ R"(usage: %s [-iv] [-c class] [-f font] [-g geometry] [-n name] [-o file]
       case 'o':
         opt_io = read_param();
         break;
+      case 'r':
+        rasterize = 1;
+        break;
       case 'n':
         opt_name = read_param();
         break;
+      case 's':
+        opt_session = read_param();
+        break;
       case 't':
       case 'T':
         opt_title = read_param();
@@ -1357,6 +2278,9 @@ run:
   setlocale(LC_CTYPE, "");
   XSetLocaleModifiers("");
   tnew(MAX(cols, 1), MAX(rows, 1));
+  /* a restored session brings its size along */
+  if (opt_session)
+    tstateopen(opt_session);
   xinit();
   selinit();
   run();